@@ -0,0 +1,204 @@
+#include "autotune.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "disk_io.hpp"
+#include "in_memory_sort.hpp"
+#include "loser_tree.hpp"
+
+namespace {
+
+constexpr size_t PROBE_BYTES = size_t(32) << 20;
+constexpr size_t PROBE_CHUNK = size_t(1) << 20;
+constexpr size_t PROBE_RANDOM_READS = 256;
+constexpr size_t PROBE_VALUES = size_t(1) << 20;
+constexpr size_t PROBE_ARITY = 16;
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Drops the file's (clean) pages so the next reads reach the device
+void dropCache(int fd) {
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+void measureDisk(const std::string& scratchFile, size_t blockBytes, DeviceProfile& p) {
+    // Blocks larger than the probe file are timed at its size
+    size_t readBytes = std::min(std::max<size_t>(blockBytes, 1), PROBE_BYTES);
+    std::vector<int64_t> chunk((std::max(PROBE_CHUNK, readBytes) + sizeof(int64_t) - 1) / sizeof(int64_t));
+    std::iota(chunk.begin(), chunk.end(), 0);
+    int fd = openForWrite(scratchFile);
+    auto t0 = Clock::now();
+    for (size_t off = 0; off < PROBE_BYTES; off += PROBE_CHUNK)
+        writeFullyAt(fd, chunk.data(), PROBE_CHUNK, off);
+    ::fdatasync(fd);
+    p.seqWriteBytesPerSec = PROBE_BYTES / secondsSince(t0);
+    closeFile(fd);
+
+    fd = openForRead(scratchFile);
+    dropCache(fd);
+    t0 = Clock::now();
+    for (size_t off = 0; off < PROBE_BYTES; off += PROBE_CHUNK)
+        readFullyAt(fd, chunk.data(), PROBE_CHUNK, off);
+    p.seqReadBytesPerSec = PROBE_BYTES / secondsSince(t0);
+
+    dropCache(fd);
+    std::mt19937_64 rng(1);
+    size_t blocks = PROBE_BYTES / readBytes;
+    t0 = Clock::now();
+    for (size_t i = 0; i < PROBE_RANDOM_READS; ++i)
+        readFullyAt(fd, chunk.data(), readBytes, (rng() % blocks) * readBytes);
+    p.randomReadSeconds = secondsSince(t0) / PROBE_RANDOM_READS;
+    closeFile(fd);
+    std::remove(scratchFile.c_str());
+}
+
+void measureCpu(DeviceProfile& p) {
+    std::mt19937_64 rng(2);
+    std::vector<int64_t> data(PROBE_VALUES);
+    for (auto& x : data) x = static_cast<int64_t>(rng());
+    auto t0 = Clock::now();
+    sortBuffer(data.data(), data.size());
+    p.sortSecondsPerCompare = secondsSince(t0) / (PROBE_VALUES * std::log2(double(PROBE_VALUES)));
+
+    // Sorted slices merged the way merge passes merge runs
+    std::vector<SpanSource> sources;
+    size_t slice = PROBE_VALUES / PROBE_ARITY;
+    for (size_t i = 0; i < PROBE_ARITY; ++i) {
+        std::sort(data.begin() + i * slice, data.begin() + (i + 1) * slice);
+        sources.emplace_back(data.data() + i * slice, data.data() + (i + 1) * slice);
+    }
+    std::vector<int64_t> out(PROBE_VALUES);
+    t0 = Clock::now();
+    LoserTree<SpanSource> tree(sources);
+    size_t k = 0;
+    int64_t v;
+    while (tree.next(v)) out[k++] = v;
+    p.mergeSecondsPerLevel = secondsSince(t0) / (PROBE_VALUES * std::log2(double(PROBE_ARITY)));
+}
+
+double log2Ceil(double x) {
+    return x <= 1 ? 0 : std::ceil(std::log2(x));
+}
+
+// Passes of a k-way merge over r runs
+int passesFor(double runs, int k) {
+    int passes = 0;
+    for (double r = runs; r > 1; r = std::ceil(r / k)) ++passes;
+    return passes;
+}
+
+} // namespace
+
+DeviceProfile measureDeviceProfile(const std::string& scratchFile, size_t blockBytes) {
+    DeviceProfile p;
+    p.blockBytes = blockBytes;
+    measureDisk(scratchFile, blockBytes, p);
+    measureCpu(p);
+    return p;
+}
+
+bool loadDeviceProfile(const std::string& filename, DeviceProfile& profile) {
+    std::ifstream in(filename);
+    if (!in) return false;
+    DeviceProfile p;
+    std::string line;
+    int fields = 0;
+    while (std::getline(in, line)) {
+        size_t space = line.find(' ');
+        if (space == std::string::npos) continue;
+        std::string key = line.substr(0, space), value = line.substr(space + 1);
+        ++fields;
+        if (key == "probe_dir") p.probeDir = value;
+        else if (key == "block_bytes") p.blockBytes = std::stoull(value);
+        else if (key == "seq_read_bytes_per_sec") p.seqReadBytesPerSec = std::stod(value);
+        else if (key == "seq_write_bytes_per_sec") p.seqWriteBytesPerSec = std::stod(value);
+        else if (key == "random_read_seconds") p.randomReadSeconds = std::stod(value);
+        else if (key == "sort_seconds_per_compare") p.sortSecondsPerCompare = std::stod(value);
+        else if (key == "merge_seconds_per_level") p.mergeSecondsPerLevel = std::stod(value);
+        else --fields;
+    }
+    if (fields < 6) return false;
+    profile = p;
+    return true;
+}
+
+void saveDeviceProfile(const std::string& filename, const DeviceProfile& p) {
+    std::ofstream out(filename);
+    out.precision(9);
+    if (!p.probeDir.empty()) out << "probe_dir " << p.probeDir << "\n";
+    out << "block_bytes " << p.blockBytes << "\n"
+        << "seq_read_bytes_per_sec " << p.seqReadBytesPerSec << "\n"
+        << "seq_write_bytes_per_sec " << p.seqWriteBytesPerSec << "\n"
+        << "random_read_seconds " << p.randomReadSeconds << "\n"
+        << "sort_seconds_per_compare " << p.sortSecondsPerCompare << "\n"
+        << "merge_seconds_per_level " << p.mergeSecondsPerLevel << "\n";
+}
+
+DeviceProfile loadOrMeasureProfile(const std::string& filename, const std::string& probeDir,
+                                   size_t blockBytes) {
+    DeviceProfile p;
+    if (loadDeviceProfile(filename, p) && p.probeDir == probeDir && p.blockBytes == blockBytes)
+        return p;
+    p = measureDeviceProfile(probeDir + "/device_profile.probe", blockBytes);
+    p.probeDir = probeDir;
+    saveDeviceProfile(filename, p);
+    return p;
+}
+
+// Cost of a pass that streams all 'bytes' in and out: sequential transfer
+// plus one seek for every buffer refill, since the streams take turns on
+// the device, plus the CPU of a 'fanIn'-way tournament per value.
+SortPlan planSort(const DeviceProfile& p, uint64_t n, size_t memBytes, size_t blockBytes) {
+    SortPlan plan;
+    double bytes = double(n) * sizeof(int64_t);
+    double transfer = bytes / p.seqReadBytesPerSec + bytes / p.seqWriteBytesPerSec;
+    auto streamPass = [&](size_t streams, double fanIn) {
+        double buf = double(blockBuffer(memBytes, streams, blockBytes));
+        return transfer + (bytes / buf) * p.randomReadSeconds +
+               double(n) * log2Ceil(fanIn) * p.mergeSecondsPerLevel;
+    };
+    double runs = std::ceil(bytes / std::max<size_t>(1, memBytes));
+    double runValues = std::min<double>(n, memBytes / sizeof(int64_t));
+    // Run formation, and equally the quicksort leaves: one read, sort and write of M-sized chunks
+    double sortOnce = transfer + double(n) * std::log2(std::max(2.0, runValues)) * p.sortSecondsPerCompare;
+    int maxWays = static_cast<int>(std::max<size_t>(3, memBytes / std::max<size_t>(1, blockBytes)));
+
+    plan.mergesortSeconds = HUGE_VAL;
+    for (int k = 2; k + 1 <= maxWays; ++k) {
+        int passes = passesFor(runs, k);
+        double t = sortOnce + passes * streamPass(k + 1, k);
+        if (t < plan.mergesortSeconds) {
+            plan.mergesortSeconds = t;
+            plan.arity = k;
+            plan.mergePasses = passes;
+            plan.mergeBufferBytes = blockBuffer(memBytes, k + 1, blockBytes);
+        }
+        if (passes <= 1 && k >= runs) break;   // Larger fan-ins only add CPU
+    }
+
+    // Each quicksort level reads one stream and partitions it into 'parts'
+    plan.quicksortSeconds = HUGE_VAL;
+    for (int parts = 2; parts + 1 <= maxWays; ++parts) {
+        int levels = passesFor(runs, parts);
+        double t = sortOnce + levels * streamPass(parts + 1, parts);
+        if (t < plan.quicksortSeconds) {
+            plan.quicksortSeconds = t;
+            plan.parts = parts;
+            plan.quicksortLevels = levels;
+        }
+        if (levels <= 1 && parts >= runs) break;
+    }
+    return plan;
+}
@@ -0,0 +1,49 @@
+#ifndef AUTOTUNE_HPP
+#define AUTOTUNE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// What the cost model needs to know about the disk and the CPU
+struct DeviceProfile {
+    size_t blockBytes = 0;              // B the latency was measured with
+    double seqReadBytesPerSec = 0;      // Streaming pread bandwidth, cache dropped
+    double seqWriteBytesPerSec = 0;     // Streaming pwrite bandwidth up to fsync
+    double randomReadSeconds = 0;       // One B-sized pread at a random offset
+    double sortSecondsPerCompare = 0;   // In-memory sort time / (n log2 n)
+    double mergeSecondsPerLevel = 0;    // Loser tree time per value per log2(arity) level
+    std::string probeDir;               // Directory whose device was measured
+};
+
+// Measures the device holding 'scratchFile' (created and removed, about
+// 32 MB) and this CPU; takes a second or two. Random reads of blocks
+// beyond 32 MB are timed at 32 MB.
+DeviceProfile measureDeviceProfile(const std::string& scratchFile, size_t blockBytes);
+
+// Profile cache: a small "key value" text file
+bool loadDeviceProfile(const std::string& filename, DeviceProfile& profile);
+void saveDeviceProfile(const std::string& filename, const DeviceProfile& profile);
+
+// Loads the cached profile for this directory and B, or measures the device
+// holding 'probeDir' (where the sort will spill) and saves it
+DeviceProfile loadOrMeasureProfile(const std::string& filename, const std::string& probeDir,
+                                   size_t blockBytes);
+
+// Parameters for sorting 'n' int64_t values with M and B
+struct SortPlan {
+    int arity = 2;                  // Mergesort fan-in
+    size_t mergeBufferBytes = 0;    // Per stream (arity inputs + output) at that arity
+    int mergePasses = 0;
+    double mergesortSeconds = 0;    // Predicted, run formation included
+    int parts = 2;                  // Quicksort partitions per level
+    int quicksortLevels = 0;
+    double quicksortSeconds = 0;    // Predicted
+};
+
+// Evaluates the cost model at every arity and partition count that leaves
+// each stream at least one block, and keeps the cheapest (no monotonicity
+// is assumed). Pure arithmetic: microseconds to milliseconds.
+SortPlan planSort(const DeviceProfile& profile, uint64_t n, size_t memBytes, size_t blockBytes);
+
+#endif // AUTOTUNE_HPP
@@ -0,0 +1,383 @@
+#include "external_mergesort.hpp"
+#include "external_quicksort.hpp"
+#include "disk_io.hpp"
+#include "io_stats.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <ios>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Benchmark harness: sorts inputs of several key distributions with both
+// external sorts over a sweep of M, B, arity (or partitions) and threads,
+// and reports throughput with 95% confidence intervals over the repetitions.
+
+namespace {
+
+const std::vector<std::string> ALL_DISTRIBUTIONS = {
+    "uniform", "sorted", "reverse", "few-unique", "zipf", "organ-pipe", "almost-sorted"};
+
+constexpr size_t GEN_CHUNK = size_t(1) << 17;      // Values generated per write
+constexpr size_t FEW_UNIQUE_KEYS = 16;
+constexpr size_t ZIPF_UNIVERSE = size_t(1) << 20;
+constexpr size_t ALMOST_SORTED_SWAPS = 100;        // One swap per this many values
+constexpr size_t ALMOST_SORTED_WINDOW = 64;        // Farthest a swapped value moves
+
+struct Config {
+    std::string alg;        // "merge" or "quick"
+    std::string dist;
+    uint64_t n = 0;
+    size_t memBytes = 0, blockBytes = 0;
+    int arity = 0;
+    size_t threads = 1;
+};
+
+// Mean and half-width of the 95% confidence interval (Student's t)
+struct Estimate {
+    double mean = 0, ci95 = 0;
+};
+
+Estimate estimate(const std::vector<double>& xs) {
+    // Two-sided 95% critical values of Student's t for 1..30 degrees of freedom
+    static const double T95[] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                                 2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+                                 2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                                 2.060,  2.056, 2.052, 2.048, 2.045, 2.042};
+    Estimate e;
+    size_t n = xs.size();
+    if (n == 0) return e;
+    for (double x : xs) e.mean += x;
+    e.mean /= n;
+    if (n < 2) return e;
+    double var = 0;
+    for (double x : xs) var += (x - e.mean) * (x - e.mean);
+    var /= n - 1;
+    double t = n - 1 <= 30 ? T95[n - 2] : 1.96;
+    e.ci95 = t * std::sqrt(var / n);
+    return e;
+}
+
+// Sizes such as 4096, 64K, 16M or 1G
+size_t parseBytes(const std::string& s) {
+    size_t pos = 0;
+    double v = std::stod(s, &pos);
+    std::string unit = s.substr(pos);
+    if (unit == "K" || unit == "k") v *= 1 << 10;
+    else if (unit == "M" || unit == "m") v *= 1 << 20;
+    else if (unit == "G" || unit == "g") v *= 1 << 30;
+    else if (!unit.empty()) throw std::invalid_argument("Bad size: " + s);
+    return static_cast<size_t>(v);
+}
+
+std::vector<std::string> splitList(const std::string& s) {
+    std::vector<std::string> items;
+    std::stringstream in(s);
+    std::string item;
+    while (std::getline(in, item, ','))
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+// Streams the values of one distribution, a chunk at a time, so inputs
+// larger than memory can be written
+class Generator {
+public:
+    Generator(const std::string& dist, uint64_t n, uint64_t seed)
+        : dist_(dist), n_(n), rng_(seed) {
+        if (dist_ == "few-unique") {
+            for (size_t i = 0; i < FEW_UNIQUE_KEYS; ++i) keys_.push_back(static_cast<int64_t>(rng_()));
+        } else if (dist_ == "zipf") {
+            // Cumulative weights of ranks 1..U with exponent 1
+            cdf_.resize(ZIPF_UNIVERSE);
+            double sum = 0;
+            for (size_t r = 0; r < ZIPF_UNIVERSE; ++r) cdf_[r] = sum += 1.0 / (r + 1);
+            for (double& c : cdf_) c /= sum;
+        } else if (std::find(ALL_DISTRIBUTIONS.begin(), ALL_DISTRIBUTIONS.end(), dist_) ==
+                   ALL_DISTRIBUTIONS.end()) {
+            throw std::invalid_argument("Unknown distribution: " + dist_);
+        }
+    }
+
+    // Fills up to chunk.size() values; returns how many
+    size_t fill(std::vector<int64_t>& chunk) {
+        size_t count = std::min<uint64_t>(chunk.size(), n_ - i_);
+        for (size_t j = 0; j < count; ++j, ++i_) chunk[j] = value(i_);
+        if (dist_ == "almost-sorted") {
+            for (size_t s = 0; s < count / ALMOST_SORTED_SWAPS; ++s) {
+                size_t a = rng_() % count;
+                size_t b = std::min(count - 1, a + 1 + rng_() % ALMOST_SORTED_WINDOW);
+                std::swap(chunk[a], chunk[b]);
+            }
+        }
+        return count;
+    }
+
+private:
+    int64_t value(uint64_t i) {
+        // Ascending sequences advance by random gaps, so keys repeat rarely
+        if (dist_ == "uniform") return static_cast<int64_t>(rng_());
+        if (dist_ == "few-unique") return keys_[rng_() % keys_.size()];
+        if (dist_ == "zipf") {
+            double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+            uint64_t rank = std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin();
+            // Scattered over the key space, so the hot keys are not all small
+            return static_cast<int64_t>((rank + 1) * 0x9E3779B97F4A7C15ULL);
+        }
+        next_ += 1 + rng_() % 1000;
+        if (dist_ == "reverse") return -next_;
+        if (dist_ == "organ-pipe") {
+            if (i == n_ / 2) peak_ = next_;
+            return i < n_ / 2 ? next_ : 2 * peak_ - next_;
+        }
+        return next_;   // sorted, almost-sorted
+    }
+
+    std::string dist_;
+    uint64_t n_, i_ = 0;
+    std::mt19937_64 rng_;
+    std::vector<int64_t> keys_;
+    std::vector<double> cdf_;
+    int64_t next_ = 0, peak_ = 0;
+};
+
+void generate(const std::string& filename, const std::string& dist, uint64_t n, uint64_t seed) {
+    Generator gen(dist, n, seed);
+    std::vector<int64_t> chunk(GEN_CHUNK);
+    int fd = openForWrite(filename);
+    uint64_t offset = 0;
+    while (size_t got = gen.fill(chunk)) {
+        writeFullyAt(fd, chunk.data(), got * sizeof(int64_t), offset);
+        offset += got * sizeof(int64_t);
+    }
+    ::fdatasync(fd);
+    closeFile(fd);
+}
+
+// Evicts the input from the page cache so each run reads it from the
+// device: the whole cache when allowed (root), else the file's own pages.
+// Returns what was done: "global", "file" or "none".
+std::string dropCaches(const std::string& filename, bool enabled) {
+    if (!enabled) return "none";
+    ::sync();
+    {
+        std::ofstream drop("/proc/sys/vm/drop_caches");
+        if (drop && (drop << "3").flush()) return "global";
+    }
+    int fd = openForRead(filename);
+    int rc = ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    closeFile(fd);
+    return rc == 0 ? "file" : "none";
+}
+
+// Order-independent fingerprint of a file's values
+struct Checksum {
+    uint64_t sum = 0, bits = 0;    // Wrapping sum and xor of the values
+    bool operator!=(const Checksum& o) const { return sum != o.sum || bits != o.bits; }
+};
+
+Checksum checksum(const MappedFile& file) {
+    Checksum c;
+    for (int64_t x : file) {
+        c.sum += static_cast<uint64_t>(x);
+        c.bits ^= static_cast<uint64_t>(x);
+    }
+    return c;
+}
+
+// Throws unless 'filename' holds 'n' values in ascending order with the
+// input's checksum, so values lost or duplicated are caught too
+void verifySorted(const std::string& filename, uint64_t n, const Checksum& input,
+                  const Config& c) {
+    MappedFile out(filename);
+    if (out.size() != n || !std::is_sorted(out.begin(), out.end()))
+        throw std::runtime_error("Unsorted output: " + c.alg + " on " + c.dist);
+    if (checksum(out) != input)
+        throw std::runtime_error("Output is not a permutation of the input: " + c.alg + " on " + c.dist);
+}
+
+struct Result {
+    Estimate ms, mbps, nsPerValue;
+    double reads = 0, writes = 0;
+    uint64_t peakBudget = 0;    // Most of the memory budget in use, over all repetitions
+    std::string cache;
+};
+
+Result runConfig(const Config& c, const std::string& inFile, const std::string& outFile,
+                 int reps, bool drop) {
+    SortOptions opts{c.blockBytes};
+    opts.threads = c.threads;
+    std::vector<double> ms, mbps, ns;
+    Result r;
+    Checksum input = checksum(MappedFile(inFile));
+    for (int rep = 0; rep < reps; ++rep) {
+        std::remove(outFile.c_str());
+        r.cache = dropCaches(inFile, drop);
+        resetIoStats();
+        auto t0 = std::chrono::steady_clock::now();
+        if (c.alg == "merge")
+            externalMergesort(inFile, outFile, c.memBytes, c.arity, opts);
+        else
+            externalQuicksort(inFile, outFile, c.memBytes, c.arity, opts);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        PhaseReport io = ioTotals();
+        r.reads += io.read.blocks;
+        r.writes += io.write.blocks;
+        r.peakBudget = std::max(r.peakBudget, io.peakBudgetBytes);
+        ms.push_back(secs * 1e3);
+        mbps.push_back(c.n * sizeof(int64_t) / 1e6 / secs);
+        ns.push_back(secs * 1e9 / std::max<uint64_t>(c.n, 1));
+        if (rep == 0) verifySorted(outFile, c.n, input, c);
+    }
+    r.ms = estimate(ms);
+    r.mbps = estimate(mbps);
+    r.nsPerValue = estimate(ns);
+    r.reads /= reps;
+    r.writes /= reps;
+    return r;
+}
+
+const char* CSV_HEADER =
+    "alg,dist,n,mem_bytes,block_bytes,arity,threads,reps,cache,time_ms,time_ms_ci95,"
+    "mb_per_s,mb_per_s_ci95,ns_per_value,ns_per_value_ci95,read_blocks,write_blocks,"
+    "peak_budget_bytes";
+
+void writeRow(std::ostream& out, bool json, const Config& c, int reps, const Result& r) {
+    if (json) {
+        out << "{\"alg\":\"" << c.alg << "\",\"dist\":\"" << c.dist << "\",\"n\":" << c.n
+            << ",\"mem_bytes\":" << c.memBytes << ",\"block_bytes\":" << c.blockBytes
+            << ",\"arity\":" << c.arity << ",\"threads\":" << c.threads << ",\"reps\":" << reps
+            << ",\"cache\":\"" << r.cache << "\",\"time_ms\":" << r.ms.mean
+            << ",\"time_ms_ci95\":" << r.ms.ci95 << ",\"mb_per_s\":" << r.mbps.mean
+            << ",\"mb_per_s_ci95\":" << r.mbps.ci95 << ",\"ns_per_value\":" << r.nsPerValue.mean
+            << ",\"ns_per_value_ci95\":" << r.nsPerValue.ci95 << ",\"read_blocks\":" << r.reads
+            << ",\"write_blocks\":" << r.writes << ",\"peak_budget_bytes\":" << r.peakBudget
+            << "}\n";
+    } else {
+        out << c.alg << ',' << c.dist << ',' << c.n << ',' << c.memBytes << ',' << c.blockBytes
+            << ',' << c.arity << ',' << c.threads << ',' << reps << ',' << r.cache << ','
+            << r.ms.mean << ',' << r.ms.ci95 << ',' << r.mbps.mean << ',' << r.mbps.ci95 << ','
+            << r.nsPerValue.mean << ',' << r.nsPerValue.ci95 << ',' << r.reads << ','
+            << r.writes << ',' << r.peakBudget << "\n";
+    }
+    out.flush();
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<std::string> dists = ALL_DISTRIBUTIONS, algs = {"merge", "quick"};
+    std::vector<size_t> mems = {size_t(4) << 20}, blocks = {4096}, threads = {1};
+    std::vector<int> arities = {8, 64};
+    uint64_t fixedN = 0, seed = 1;
+    size_t scale = 8;
+    int reps = 5;
+    bool drop = true, json = false;
+    std::string outPath = "benchmark.csv", dir = ".";
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string flag = argv[i];
+            auto value = [&](size_t prefix) { return flag.substr(prefix); };
+            if (flag.rfind("--dists=", 0) == 0) {
+                dists = splitList(value(8));
+            } else if (flag.rfind("--algs=", 0) == 0) {
+                algs = splitList(value(7));
+            } else if (flag.rfind("--mem=", 0) == 0) {
+                mems.clear();
+                for (auto& s : splitList(value(6))) mems.push_back(parseBytes(s));
+            } else if (flag.rfind("--block=", 0) == 0) {
+                blocks.clear();
+                for (auto& s : splitList(value(8))) blocks.push_back(parseBytes(s));
+            } else if (flag.rfind("--arity=", 0) == 0) {
+                arities.clear();
+                for (auto& s : splitList(value(8))) arities.push_back(std::stoi(s));
+            } else if (flag.rfind("--threads=", 0) == 0) {
+                threads.clear();
+                for (auto& s : splitList(value(10))) threads.push_back(std::stoul(s));
+            } else if (flag.rfind("--n=", 0) == 0) {
+                fixedN = std::stoull(value(4));
+            } else if (flag.rfind("--scale=", 0) == 0) {
+                scale = std::stoul(value(8));
+            } else if (flag.rfind("--reps=", 0) == 0) {
+                reps = std::max(1, std::stoi(value(7)));
+            } else if (flag.rfind("--seed=", 0) == 0) {
+                seed = std::stoull(value(7));
+            } else if (flag.rfind("--dir=", 0) == 0) {
+                dir = value(6);
+            } else if (flag.rfind("--out=", 0) == 0) {
+                outPath = value(6);
+            } else if (flag == "--format=json") {
+                json = true;
+            } else if (flag == "--format=csv") {
+                json = false;
+            } else if (flag == "--no-drop-cache") {
+                drop = false;
+            } else {
+                throw std::invalid_argument("Unknown option: " + flag);
+            }
+        }
+        for (auto& a : algs)
+            if (a != "merge" && a != "quick") throw std::invalid_argument("Unknown algorithm: " + a);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n"
+                  << "Usage: " << argv[0]
+                  << " [--dists=uniform,sorted,reverse,few-unique,zipf,organ-pipe,almost-sorted]"
+                  << " [--algs=merge,quick] [--mem=4M,...] [--block=4K,...] [--arity=8,64,...]"
+                  << " [--threads=1,...] [--n=N|--scale=K] [--reps=R] [--seed=S] [--dir=DIR]"
+                  << " [--out=FILE] [--format=csv|json] [--no-drop-cache]\n";
+        return 1;
+    }
+
+    // JSON output is one object per line, so partial results stay parseable
+    std::ofstream out(outPath);
+    if (!json) out << CSV_HEADER << "\n";
+    std::cout << std::left << std::setw(6) << "alg" << std::setw(14) << "dist" << std::setw(11)
+              << "n" << std::setw(10) << "M" << std::setw(7) << "B" << std::setw(6) << "k"
+              << std::setw(4) << "t" << "MB/s (±95%)          ns/value (±95%)\n";
+    std::string inFile = dir + "/bench_input.bin", outFile = dir + "/bench_output.bin";
+    for (const auto& dist : dists) {
+        uint64_t generatedN = 0;
+        bool generated = false;
+        for (size_t mem : mems) {
+            uint64_t n = fixedN > 0 ? fixedN : scale * mem / sizeof(int64_t);
+            // Every configuration of a distribution and size sorts the same input
+            if (!generated || n != generatedN) {
+                generate(inFile, dist, n, seed);
+                generatedN = n;
+                generated = true;
+            }
+            for (size_t block : blocks)
+                for (int arity : arities)
+                    for (size_t t : threads)
+                        for (const auto& alg : algs) {
+                            Config c{alg, dist, n, mem, block, arity, t};
+                            Result r = runConfig(c, inFile, outFile, reps, drop);
+                            writeRow(out, json, c, reps, r);
+                            std::ostringstream mbps, ns;
+                            mbps << std::fixed << std::setprecision(1) << r.mbps.mean << " ± "
+                                 << r.mbps.ci95;
+                            ns << std::fixed << std::setprecision(2) << r.nsPerValue.mean
+                               << " ± " << r.nsPerValue.ci95;
+                            std::cout << std::setw(6) << alg << std::setw(14) << dist
+                                      << std::setw(11) << n << std::setw(10) << mem
+                                      << std::setw(7) << block << std::setw(6) << arity
+                                      << std::setw(4) << t << std::setw(21) << mbps.str()
+                                      << ns.str() << "\n";
+                        }
+        }
+    }
+    std::remove(inFile.c_str());
+    std::remove(outFile.c_str());
+    std::cout << "Results written to " << outPath << " (cache dropping: "
+              << (drop ? "on" : "off") << ")\n";
+    return 0;
+}
@@ -2,6 +2,16 @@
 #include <fstream>     // For file I/O
 #include <string>      // Explicit include for std::string
 #include <algorithm>   // For std::sort
+#include <chrono>      // For I/O latencies
+#include <cerrno>      // For errno
+#include <cstring>     // For memcpy
+#include <fcntl.h>     // For open/posix_fadvise
+#include <sys/mman.h>  // For mmap/madvise
+#include <unistd.h>    // For pread/pwrite/close
+#include "in_memory_sort.hpp"
+#include "io_stats.hpp"
+#include "run_codec.hpp"
+#include "thread_pool.hpp"
 
 // Template implementation with explicit instantiation
 template<typename T>
@@ -13,27 +23,624 @@ size_t getFileSize(const std::string& filename) {
 // Explicit instantiation for int64_t
 template size_t getFileSize<int64_t>(const std::string&);
 
+namespace {
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+uint64_t roundUp(uint64_t x, uint64_t to) {
+    return (x + to - 1) / to * to;
+}
+
+// Queue of a stream's asynchronous transfers: per device for scratch runs
+ThreadPool& ioPoolOf(const ScratchSpace* scratch, const ScratchRun* run) {
+    return scratch ? scratch->ioPool(run->file) : ioThreadPool();
+}
+
+// Values per stream buffer; buffers on O_DIRECT scratch are whole aligned units
+size_t bufferValues(size_t bufferBytes, bool direct) {
+    if (direct) bufferBytes = roundUp(bufferBytes, ScratchSpace::DIRECT_ALIGN);
+    return std::max<size_t>(1, bufferBytes / sizeof(int64_t));
+}
+
+} // namespace
+
 // Read integers from a file
 std::vector<int64_t> readInts(const std::string& filename, size_t start, size_t count) {
     std::vector<int64_t> data(count);
-    std::ifstream in(filename, std::ios::binary);
-    in.seekg(start * sizeof(int64_t), std::ios::beg);
-    in.read(reinterpret_cast<char*>(data.data()), count * sizeof(int64_t));
-    data.resize(in.gcount() / sizeof(int64_t));
+    data.resize(readInts(filename, start, data.data(), count));
     return data;
 }
 
+size_t readInts(const std::string& filename, size_t start, int64_t* dst, size_t count) {
+    int fd = openForRead(filename);
+    size_t bytes = readFullyAt(fd, dst, count * sizeof(int64_t), start * sizeof(int64_t));
+    closeFile(fd);
+    return bytes / sizeof(int64_t);
+}
+
 // Append integers to a file
 void appendInts(const std::string& filename, const std::vector<int64_t>& data) {
+    auto t0 = std::chrono::steady_clock::now();
     std::ofstream out(filename, std::ios::binary | std::ios::app);
+    uint64_t offset = out.tellp();
     out.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(int64_t));
+    out.flush();
+    recordWrite(offset, data.size() * sizeof(int64_t), secondsSince(t0));
+}
+
+// Sort a small file in memory: the input mapping is copied straight into the
+// output file's mapping and sorted there, with no intermediate buffer. A
+// selection compacts the mapping and then cuts the file to what it kept.
+void sortInMemory(const std::string& inFile, const std::string& outFile,
+                  const SortOptions& opts) {
+    MappedFile in(inFile, opts);
+    size_t n = in.size();
+    {
+        MappedFile out = MappedFile::create(outFile, in.size());
+        std::copy(in.begin(), in.end(), out.data());
+        if (selective(opts)) n = keepInRange(out.data(), n, opts.minKey, opts.maxKey);
+        sortBuffer(out.data(), n, opts.inMemorySort);
+        if (selective(opts)) n = trimSorted(out.data(), n, opts.limit, opts.distinct);
+    }
+    if (n != in.size()) truncateFile(outFile, n * sizeof(int64_t));
+}
+
+namespace {
+
+int openOrThrow(const std::string& filename, int flags) {
+    int fd = ::open(filename.c_str(), flags, 0644);
+    if (fd < 0)
+        throw std::ios_base::failure("Failed to open file: " + filename);
+    return fd;
+}
+
+} // namespace
+
+// pread() until 'bytes' are in or EOF is hit, returns bytes read
+size_t readFullyAt(int fd, void* dst, size_t bytes, uint64_t offset) {
+    char* p = static_cast<char*>(dst);
+    size_t done = 0;
+    while (done < bytes) {
+        auto t0 = std::chrono::steady_clock::now();
+        ssize_t r = ::pread(fd, p + done, bytes - done, offset + done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) throw std::ios_base::failure("read failed");
+        recordRead(offset + done, r, secondsSince(t0));
+        if (r == 0) break;
+        done += r;
+    }
+    return done;
+}
+
+void writeFullyAt(int fd, const void* src, size_t bytes, uint64_t offset) {
+    const char* p = static_cast<const char*>(src);
+    while (bytes > 0) {
+        auto t0 = std::chrono::steady_clock::now();
+        ssize_t w = ::pwrite(fd, p, bytes, offset);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) throw std::ios_base::failure("write failed");
+        recordWrite(offset, w, secondsSince(t0));
+        p += w;
+        bytes -= w;
+        offset += w;
+    }
+}
+
+int openForRead(const std::string& filename) {
+    return openOrThrow(filename, O_RDONLY);
+}
+
+int openForWrite(const std::string& filename) {
+    return openOrThrow(filename, O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+void closeFile(int fd) {
+    if (fd >= 0) ::close(fd);
+}
+
+size_t blockBuffer(size_t memBytes, size_t ways, size_t blockBytes) {
+    blockBytes = std::max<size_t>(blockBytes, sizeof(int64_t));
+    size_t blocks = memBytes / std::max<size_t>(1, ways) / blockBytes;
+    return std::max<size_t>(1, blocks) * blockBytes;
+}
+
+size_t streamBytes(size_t bufferBytes, size_t depth, bool packed, const SortOptions& opts) {
+    // As the arena charges them: buffers round up to cache lines
+    auto charged = [](size_t bytes) { return roundUp(bytes, 64); };
+    bufferBytes = bufferValues(bufferBytes, opts.directIo) * sizeof(int64_t);
+    depth = std::max<size_t>(1, depth);
+    if (!packed) return depth * charged(bufferBytes);
+    // Bounds both sides: a reader holds disk buffers, a decoded block and the
+    // undecoded bytes; a writer a value buffer and encoded ones
+    return depth * charged(packedBound(bufferBytes / sizeof(int64_t))) +
+           charged(PACKED_BLOCK_VALUES * sizeof(int64_t)) +
+           charged(bufferBytes + packedBound(PACKED_BLOCK_VALUES));
+}
+
+size_t streamBuffer(size_t memBytes, size_t streams, size_t depth, bool packed,
+                    const SortOptions& opts) {
+    size_t block = std::max<size_t>(opts.blockBytes, sizeof(int64_t));
+    streams = std::max<size_t>(1, streams);
+    size_t buf = blockBuffer(memBytes, streams * std::max<size_t>(1, depth) * (packed ? 2 : 1), block);
+    while (buf > block && streams * streamBytes(buf, depth, packed, opts) > memBytes)
+        buf -= block;
+    return buf;
+}
+
+size_t sortBudget(size_t memBytes, const SortOptions& opts) {
+    size_t block = std::max<size_t>(opts.blockBytes, sizeof(int64_t));
+    return std::max(memBytes, 4 * streamBytes(block, opts.ioDepth, opts.packRuns, opts));
+}
+
+void preallocateFile(const std::string& filename, uint64_t bytes) {
+    int fd = openOrThrow(filename, O_WRONLY | O_CREAT | O_TRUNC);
+    int err = bytes > 0 ? ::posix_fallocate(fd, 0, bytes) : 0;
+    if (err != 0 && ::ftruncate(fd, bytes) != 0) {
+        ::close(fd);
+        throw std::ios_base::failure("Failed to preallocate file: " + filename);
+    }
+    ::close(fd);
+}
+
+void truncateFile(const std::string& filename, uint64_t bytes) {
+    if (::truncate(filename.c_str(), bytes) != 0)
+        throw std::ios_base::failure("Failed to truncate file: " + filename);
+}
+
+MappedFile::MappedFile(const std::string& filename, const SortOptions& opts) {
+    int fd = openOrThrow(filename, O_RDONLY);
+    size_ = ::lseek(fd, 0, SEEK_END) / sizeof(int64_t);
+    try {
+        map(fd, PROT_READ, MAP_PRIVATE | (opts.mapPopulate ? MAP_POPULATE : 0));
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    advise(opts);
+}
+
+MappedFile::MappedFile(const ScratchSpace& scratch, const ScratchRun& run,
+                       const SortOptions& opts) {
+    size_ = run.size();
+    if (size_ == 0) return;
+    auto t0 = std::chrono::steady_clock::now();
+    size_t extent = scratch.extentBytes();
+    size_t used = (size_ * sizeof(int64_t) + extent - 1) / extent;
+    // Reserve the address range, then map every extent over its slot
+    void* base = ::mmap(nullptr, used * extent, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        throw std::ios_base::failure("mmap failed");
+    char* slot = static_cast<char*>(base);
+    int flags = MAP_PRIVATE | MAP_FIXED | (opts.mapPopulate ? MAP_POPULATE : 0);
+    for (size_t i = 0; i < used; ++i) {
+        const Extent& e = run.extents[i];
+        if (::mmap(slot + i * extent, extent, PROT_READ, flags, scratch.fd(e.file), e.offset) == MAP_FAILED) {
+            ::munmap(base, used * extent);
+            throw std::ios_base::failure("mmap failed");
+        }
+    }
+    data_ = static_cast<int64_t*>(base);
+    mapBytes_ = used * extent;
+    recordRead(0, size_ * sizeof(int64_t), secondsSince(t0));
+    advise(opts);
+}
+
+void MappedFile::advise(const SortOptions& opts) {
+    if (!data_) return;
+    size_t bytes = size_ * sizeof(int64_t);
+    ::madvise(data_, bytes, MADV_SEQUENTIAL);
+    ::madvise(data_, bytes, MADV_WILLNEED);
+    if (opts.mapHugePages) ::madvise(data_, bytes, MADV_HUGEPAGE); // Best effort
+}
+
+MappedFile MappedFile::create(const std::string& filename, uint64_t count) {
+    preallocateFile(filename, count * sizeof(int64_t));
+    int fd = openOrThrow(filename, O_RDWR);
+    MappedFile f;
+    f.size_ = count;
+    try {
+        f.map(fd, PROT_READ | PROT_WRITE, MAP_SHARED);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    return f;
+}
+
+// A mapping counts as one call moving the whole file: its pages are read
+// (or written back) by the kernel rather than by syscalls of ours
+void MappedFile::map(int fd, int prot, int flags) {
+    if (size_ == 0) return;
+    auto t0 = std::chrono::steady_clock::now();
+    void* p = ::mmap(nullptr, size_ * sizeof(int64_t), prot, flags, fd, 0);
+    if (p == MAP_FAILED)
+        throw std::ios_base::failure("mmap failed");
+    data_ = static_cast<int64_t*>(p);
+    mapBytes_ = size_ * sizeof(int64_t);
+    if (prot & PROT_WRITE) recordWrite(0, size_ * sizeof(int64_t), secondsSince(t0));
+    else recordRead(0, size_ * sizeof(int64_t), secondsSince(t0));
+}
+
+MappedFile::~MappedFile() {
+    if (data_) ::munmap(data_, mapBytes_);
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : data_(other.data_), size_(other.size_), mapBytes_(other.mapBytes_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+}
+
+PositionalReader::PositionalReader(const std::string& filename)
+    : fd_(openOrThrow(filename, O_RDONLY)),
+      size_(::lseek(fd_, 0, SEEK_END) / sizeof(int64_t)) {}
+
+PositionalReader::PositionalReader(const ScratchSpace& scratch, const ScratchRun& run)
+    : fd_(-1), size_(run.size()), scratch_(&scratch), run_(&run) {}
+
+PositionalReader::~PositionalReader() {
+    if (fd_ >= 0) ::close(fd_);
+}
+
+PositionalReader::PositionalReader(PositionalReader&& other) noexcept
+    : fd_(other.fd_), size_(other.size_), scratch_(other.scratch_), run_(other.run_) {
+    other.fd_ = -1;
+}
+
+int64_t PositionalReader::at(uint64_t index) const {
+    int64_t v = 0;
+    if (readAt(&v, 1, index) != 1)
+        throw std::ios_base::failure("read past end of file");
+    return v;
+}
+
+size_t PositionalReader::readAt(int64_t* dst, size_t count, uint64_t index) const {
+    if (scratch_)
+        return scratch_->read(*run_, index * sizeof(int64_t), dst, count * sizeof(int64_t)) / sizeof(int64_t);
+    return readFullyAt(fd_, dst, count * sizeof(int64_t), index * sizeof(int64_t)) / sizeof(int64_t);
+}
+
+RunReader::RunReader(const std::string& filename, size_t bufferBytes, size_t depth,
+                     uint64_t first, uint64_t last)
+    : fd_(openOrThrow(filename, O_RDONLY)),
+      buf_(bufferValues(bufferBytes, false)),
+      offset_(first * sizeof(int64_t)),
+      end_(last == UINT64_MAX ? UINT64_MAX : last * sizeof(int64_t)) {
+    ::posix_fadvise(fd_, offset_, 0, POSIX_FADV_SEQUENTIAL);
+    for (size_t i = 1; i < depth; ++i)
+        prefetch(IoBuffer(buf_.size()));
+}
+
+RunReader::RunReader(const ScratchSpace& scratch, const ScratchRun& run, size_t bufferBytes,
+                     size_t depth, uint64_t first, uint64_t last)
+    : fd_(-1), scratch_(&scratch), run_(&run),
+      buf_(bufferValues(bufferBytes, scratch.direct())),
+      offset_(first * sizeof(int64_t)),
+      end_(std::min<uint64_t>(run.bytes, last == UINT64_MAX ? UINT64_MAX : last * sizeof(int64_t))) {
+    for (size_t i = 1; i < depth; ++i)
+        prefetch(IoBuffer(buf_.size()));
+}
+
+RunReader RunReader::packed(const std::string& filename, size_t bufferBytes, size_t depth) {
+    RunReader r(filename, bufferBytes, depth);
+    r.usePacked();
+    return r;
+}
+
+RunReader RunReader::packed(const ScratchSpace& scratch, const ScratchRun& run,
+                            size_t bufferBytes, size_t depth) {
+    RunReader r(scratch, run, bufferBytes, depth);
+    r.usePacked();
+    return r;
+}
+
+// Disk buffers keep their size; values are decoded a block at a time. The
+// value buffer becomes the first disk buffer, so no memory is held twice.
+void RunReader::usePacked() {
+    packed_ = true;
+    raw_ = std::move(buf_);
+    buf_ = IoBuffer(PACKED_BLOCK_VALUES);
+    // Undecoded bytes never exceed a disk buffer plus a partial block
+    pending_.reserve(raw_.size() * sizeof(int64_t) + packedBound(PACKED_BLOCK_VALUES));
+}
+
+RunReader::~RunReader() {
+    for (auto& p : ahead_)
+        if (p.bytes.valid()) p.bytes.wait();
+    if (fd_ >= 0) ::close(fd_);
+}
+
+RunReader::RunReader(RunReader&& other) noexcept
+    : fd_(other.fd_), scratch_(other.scratch_), run_(other.run_),
+      buf_(std::move(other.buf_)), pos_(other.pos_), len_(other.len_),
+      offset_(other.offset_), end_(other.end_), eof_(other.eof_),
+      ahead_(std::move(other.ahead_)), packed_(other.packed_), raw_(std::move(other.raw_)),
+      pending_(std::move(other.pending_)), pendingPos_(other.pendingPos_) {
+    other.fd_ = -1;
+}
+
+// Read of bytes [offset_, offset_ + want) into 'dst', to run now or on the
+// I/O pool. On O_DIRECT scratch an aligned read is widened up to 'room'
+// bytes so that it can bypass the cache; only 'want' bytes are reported.
+std::function<size_t()> RunReader::readTask(int64_t* dst, size_t want, size_t room) {
+    if (!scratch_) {
+        int fd = fd_;
+        uint64_t offset = offset_;
+        return [fd, dst, want, offset]() { return readFullyAt(fd, dst, want, offset); };
+    }
+    size_t span = want;
+    if (scratch_->direct() && offset_ % ScratchSpace::DIRECT_ALIGN == 0)
+        span = std::max(want, std::min<size_t>(roundUp(want, ScratchSpace::DIRECT_ALIGN), room));
+    const ScratchSpace* scratch = scratch_;
+    auto pieces = scratch_->locate(*run_, offset_, span);
+    return [scratch, pieces, dst, want]() {
+        return std::min(scratch->readPieces(pieces, dst), want);
+    };
+}
+
+void RunReader::prefetch(IoBuffer buf) {
+    if (eof_) return;
+    size_t room = buf.size() * sizeof(int64_t);
+    size_t bytes = std::min<uint64_t>(room, end_ - offset_);
+    auto task = readTask(buf.data(), bytes, room);
+    offset_ += bytes;
+    if (bytes < room) eof_ = true;
+    auto done = ioPoolOf(scratch_, run_).submit(std::move(task));
+    ahead_.push_back({std::move(buf), std::move(done)});
+}
+
+// Fills 'into' with the next bytes of the file, returns how many arrived
+size_t RunReader::fetch(IoBuffer& into) {
+    size_t bytes;
+    if (ahead_.empty()) {
+        if (eof_) return 0;
+        size_t room = into.size() * sizeof(int64_t);
+        size_t want = std::min<uint64_t>(room, end_ - offset_);
+        bytes = readTask(into.data(), want, room)();
+        offset_ += bytes;
+        if (bytes < into.size() * sizeof(int64_t)) eof_ = true;
+    } else {
+        // Swap in the oldest read-ahead buffer and reissue the consumed one
+        Pending p = std::move(ahead_.front());
+        ahead_.pop_front();
+        bytes = p.bytes.get();
+        std::swap(into, p.buf);
+        if (bytes < into.size() * sizeof(int64_t)) eof_ = true;
+        prefetch(std::move(p.buf));
+    }
+    return bytes;
+}
+
+bool RunReader::refill() {
+    if (packed_) return refillPacked();
+    pos_ = 0;
+    len_ = fetch(buf_) / sizeof(int64_t);
+    return len_ > 0;
 }
 
-// Sort a small file in memory
-void sortInMemory(const std::string& inFile, const std::string& outFile) {
-    size_t n = getFileSize<int64_t>(inFile) / sizeof(int64_t);
-    auto v = readInts(inFile, 0, n);
-    std::sort(v.begin(), v.end());
-    std::ofstream out(outFile, std::ios::binary);
-    out.write(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(int64_t));
-}
\ No newline at end of file
+// Decodes the next whole block, pulling disk buffers until one is complete
+bool RunReader::refillPacked() {
+    pos_ = len_ = 0;
+    while (true) {
+        size_t avail = pending_.size() - pendingPos_;
+        if (avail >= sizeof(PackedHeader)) {
+            PackedHeader h;
+            std::memcpy(&h, pending_.data() + pendingPos_, sizeof(h));
+            size_t bytes = packedBlockBytes(h);
+            if (avail >= bytes) {
+                if (buf_.size() < h.count) buf_.resize(h.count);
+                unpackBlock(pending_.data() + pendingPos_, buf_.data());
+                pendingPos_ += bytes;
+                len_ = h.count;
+                if (len_ > 0) return true;
+                continue;
+            }
+        }
+        size_t bytes = fetch(raw_);
+        if (bytes == 0) return false;
+        pending_.erase(pending_.begin(), pending_.begin() + pendingPos_);
+        pendingPos_ = 0;
+        const unsigned char* in = reinterpret_cast<const unsigned char*>(raw_.data());
+        pending_.insert(pending_.end(), in, in + bytes);
+    }
+}
+
+size_t RunReader::read(int64_t* dst, size_t count) {
+    // Drain what is buffered, then read large requests straight into 'dst'
+    size_t got = std::min(count, len_ - pos_);
+    std::copy(buf_.begin() + pos_, buf_.begin() + pos_ + got, dst);
+    pos_ += got;
+    if (got == count) return got;
+    if (!packed_ && ahead_.empty() && !eof_ && count - got >= buf_.size()) {
+        size_t want = std::min<uint64_t>((count - got) * sizeof(int64_t), end_ - offset_);
+        size_t bytes = readTask(dst + got, want, want)();
+        offset_ += bytes;
+        if (bytes < (count - got) * sizeof(int64_t)) eof_ = true;
+        return got + bytes / sizeof(int64_t);
+    }
+    while (got < count && refill()) {
+        size_t n = std::min(count - got, len_);
+        std::copy(buf_.begin(), buf_.begin() + n, dst + got);
+        pos_ = n;
+        got += n;
+    }
+    return got;
+}
+
+RunWriter::RunWriter(const std::string& filename, size_t bufferBytes, bool append,
+                     size_t depth)
+    : fd_(openOrThrow(filename, O_WRONLY | O_CREAT | (append ? 0 : O_TRUNC))),
+      buf_(bufferValues(bufferBytes, false)),
+      depth_(std::max<size_t>(1, depth)) {
+    // Positional writes ignore O_APPEND, so start at the current end instead
+    if (append) offset_ = ::lseek(fd_, 0, SEEK_END);
+}
+
+RunWriter::RunWriter(ScratchSpace& scratch, ScratchRun& run, size_t bufferBytes, size_t depth)
+    : fd_(-1), scratch_(&scratch), run_(&run),
+      buf_(bufferValues(bufferBytes, scratch.direct())),
+      offset_(run.bytes),
+      depth_(std::max<size_t>(1, depth)) {}
+
+RunWriter RunWriter::at(const std::string& filename, size_t bufferBytes, uint64_t first,
+                        size_t depth) {
+    RunWriter w(filename, bufferBytes, true, depth);
+    w.offset_ = first * sizeof(int64_t);
+    return w;
+}
+
+RunWriter RunWriter::packed(const std::string& filename, size_t bufferBytes, size_t depth) {
+    RunWriter w(filename, bufferBytes, false, depth);
+    w.packed_ = true;
+    w.encoded_.resize((packedBound(w.buf_.size()) + sizeof(int64_t) - 1) / sizeof(int64_t));
+    return w;
+}
+
+RunWriter RunWriter::packed(ScratchSpace& scratch, ScratchRun& run, size_t bufferBytes,
+                            size_t depth) {
+    RunWriter w(scratch, run, bufferBytes, depth);
+    w.packed_ = true;
+    w.encoded_.resize((packedBound(w.buf_.size()) + sizeof(int64_t) - 1) / sizeof(int64_t));
+    return w;
+}
+
+RunWriter::~RunWriter() {
+    try {
+        close();
+    } catch (...) {
+    }
+}
+
+RunWriter::RunWriter(RunWriter&& other) noexcept
+    : fd_(other.fd_), scratch_(other.scratch_), run_(other.run_),
+      buf_(std::move(other.buf_)), len_(other.len_),
+      offset_(other.offset_), depth_(other.depth_), behind_(std::move(other.behind_)),
+      packed_(other.packed_), encoded_(std::move(other.encoded_)) {
+    other.fd_ = -1;
+    other.run_ = nullptr;
+    other.len_ = 0;
+}
+
+RunWriter& RunWriter::operator=(RunWriter&& other) {
+    if (this != &other) {
+        close();
+        fd_ = other.fd_;
+        scratch_ = other.scratch_;
+        run_ = other.run_;
+        buf_ = std::move(other.buf_);
+        len_ = other.len_;
+        offset_ = other.offset_;
+        depth_ = other.depth_;
+        behind_ = std::move(other.behind_);
+        packed_ = other.packed_;
+        encoded_ = std::move(other.encoded_);
+        other.fd_ = -1;
+        other.run_ = nullptr;
+        other.len_ = 0;
+    }
+    return *this;
+}
+
+void RunWriter::write(const int64_t* src, size_t count) {
+    if (packed_) {
+        // Everything goes through the buffer so that it gets encoded
+        while (count > 0) {
+            if (len_ == buf_.size()) flush();
+            size_t n = std::min(count, buf_.size() - len_);
+            std::copy(src, src + n, buf_.begin() + len_);
+            len_ += n;
+            src += n;
+            count -= n;
+        }
+        return;
+    }
+    if (len_ + count <= buf_.size()) {
+        std::copy(src, src + count, buf_.begin() + len_);
+        len_ += count;
+        return;
+    }
+    flush();
+    if (count >= buf_.size()) {
+        writeTask(src, count * sizeof(int64_t), false)();
+        offset_ += count * sizeof(int64_t);
+        return;
+    }
+    std::copy(src, src + count, buf_.begin());
+    len_ = count;
+}
+
+// Write of 'bytes' from 'src' at offset_, to run now or on the I/O pool. A
+// scratch run gets the extents first; on O_DIRECT scratch the last, partial
+// buffer of a plain run is padded to the alignment (past the run's end).
+std::function<void()> RunWriter::writeTask(const int64_t* src, size_t bytes, bool last) {
+    if (!scratch_) {
+        int fd = fd_;
+        uint64_t offset = offset_;
+        return [fd, src, bytes, offset]() { writeFullyAt(fd, src, bytes, offset); };
+    }
+    size_t span = bytes;
+    if (last && !packed_ && scratch_->direct() && offset_ % ScratchSpace::DIRECT_ALIGN == 0)
+        span = roundUp(bytes, ScratchSpace::DIRECT_ALIGN);
+    scratch_->reserve(*run_, offset_ + span);
+    run_->bytes = offset_ + bytes;
+    const ScratchSpace* scratch = scratch_;
+    auto pieces = scratch_->locate(*run_, offset_, span);
+    return [scratch, pieces, src]() { scratch->writePieces(pieces, src); };
+}
+
+void RunWriter::flush() {
+    flushBuffer(false);
+}
+
+void RunWriter::flushBuffer(bool last) {
+    if (len_ == 0) return;
+    IoBuffer& out = packed_ ? encoded_ : buf_;
+    size_t bytes = packed_ ? packValues(buf_.data(), len_, encoded_.data())
+                           : len_ * sizeof(int64_t);
+    if (depth_ == 1) {
+        writeTask(out.data(), bytes, last)();
+    } else {
+        // Hand the full buffer to the I/O pool and continue in a free one
+        IoBuffer spare;
+        if (behind_.size() + 1 >= depth_) {
+            behind_.front().done.get();
+            spare = std::move(behind_.front().buf);
+            behind_.pop_front();
+        } else {
+            spare.resize(out.size());
+        }
+        auto done = ioPoolOf(scratch_, run_).submit(writeTask(out.data(), bytes, last));
+        behind_.push_back({std::move(out), std::move(done)});
+        out = std::move(spare);
+    }
+    offset_ += bytes;
+    len_ = 0;
+}
+
+void RunWriter::close() {
+    if (fd_ < 0 && !run_) return;
+    try {
+        flushBuffer(true);
+        while (!behind_.empty()) {
+            behind_.front().done.get();
+            behind_.pop_front();
+        }
+    } catch (...) {
+        for (auto& p : behind_) p.done.wait();
+        behind_.clear();
+        closeFile(fd_);
+        fd_ = -1;
+        run_ = nullptr;
+        throw;
+    }
+    closeFile(fd_);
+    fd_ = -1;
+    run_ = nullptr;
+    // A closed writer holds no memory, so the next one can take its share
+    buf_ = IoBuffer();
+    encoded_ = IoBuffer();
+}
@@ -5,6 +5,14 @@
 #include <vector>       // Include for std::vector
 #include <cstdint>      // For int64_t
 #include <cstddef>      // For size_t
+#include <deque>        // For in-flight buffers
+#include <functional>   // For I/O tasks
+#include <future>       // For async reads and writes
+#include <new>          // For aligned operator new
+#include <type_traits>  // For allocator traits
+#include "memory_arena.hpp"
+#include "scratch.hpp"
+#include "sort_options.hpp"
 
 // Template declaration for file size
 template<typename T>
@@ -12,11 +20,267 @@ size_t getFileSize(const std::string& filename);
 
 // Read 'count' int64_t values starting at 'start'
 std::vector<int64_t> readInts(const std::string& filename, size_t start, size_t count);
+// Same, into a buffer the caller reuses; returns the values read
+size_t readInts(const std::string& filename, size_t start, int64_t* dst, size_t count);
 
 // Append values to a binary file
 void appendInts(const std::string& filename, const std::vector<int64_t>& data);
 
-// Sort small files in memory
-void sortInMemory(const std::string& inFile, const std::string& outFile);
+// Sort small files in memory, applying the selection in opts
+void sortInMemory(const std::string& inFile, const std::string& outFile,
+                  const SortOptions& opts = {});
 
-#endif
\ No newline at end of file
+// Raw descriptor helpers for typed readers and writers built outside this file
+int openForRead(const std::string& filename);
+int openForWrite(const std::string& filename);   // Creates or truncates
+void closeFile(int fd);
+
+// pread() until 'bytes' are in or EOF is hit, returns bytes read
+size_t readFullyAt(int fd, void* dst, size_t bytes, uint64_t offset);
+
+// pwrite() all of 'bytes', retrying short writes
+void writeFullyAt(int fd, const void* src, size_t bytes, uint64_t offset);
+
+// Splits a memory budget into 'ways' buffers of whole blocks (at least one block each)
+size_t blockBuffer(size_t memBytes, size_t ways, size_t blockBytes);
+
+// Memory a RunReader or RunWriter over 'bufferBytes' buffers holds: 'depth'
+// of them, plus the decode or encode buffers of a packed stream
+size_t streamBytes(size_t bufferBytes, size_t depth, bool packed, const SortOptions& opts);
+
+// Largest buffer (whole blocks, at least one) that lets 'streams' such
+// streams share memBytes
+size_t streamBuffer(size_t memBytes, size_t streams, size_t depth, bool packed,
+                    const SortOptions& opts);
+
+// Memory budget of a sort asked to run within memBytes: M itself, raised to
+// the smallest working set that can still sort (four one-block streams).
+// The arena of the sort is this large.
+size_t sortBudget(size_t memBytes, const SortOptions& opts);
+
+// Creates (or truncates) a file of exactly 'bytes' bytes with its space reserved
+void preallocateFile(const std::string& filename, uint64_t bytes);
+
+// Cuts an existing file down (or extends it) to exactly 'bytes' bytes
+void truncateFile(const std::string& filename, uint64_t bytes);
+
+// Allocator of page-aligned storage, so stream buffers can be used for
+// O_DIRECT. Storage is charged to the arena current when the allocator
+// was made (see ArenaScope), and moves along with the container.
+template<typename T>
+struct PageAlignedAllocator {
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+    PageAlignedAllocator() : arena(currentArena()) {}
+    template<typename U>
+    PageAlignedAllocator(const PageAlignedAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        if (arena) return static_cast<T*>(arena->allocate(n * sizeof(T)));
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(ScratchSpace::DIRECT_ALIGN)));
+    }
+    void deallocate(T* p, size_t n) {
+        if (arena) arena->deallocate(p, n * sizeof(T));
+        else ::operator delete(p, std::align_val_t(ScratchSpace::DIRECT_ALIGN));
+    }
+    template<typename U>
+    bool operator==(const PageAlignedAllocator<U>& other) const { return arena == other.arena; }
+    template<typename U>
+    bool operator!=(const PageAlignedAllocator<U>& other) const { return arena != other.arena; }
+
+    MemoryArena* arena;
+};
+
+// Buffer of a RunReader or RunWriter, and of the values a sort holds in memory
+using IoBuffer = std::vector<int64_t, PageAlignedAllocator<int64_t>>;
+
+// Memory mapping of an int64_t file exposed as a span of values, so the file
+// is consumed without copying it into a buffer
+class MappedFile {
+public:
+    // Read-only view of an existing file, advised for sequential access
+    explicit MappedFile(const std::string& filename, const SortOptions& opts = {});
+    ~MappedFile();
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&&) = delete;
+
+    // Read-only view of a scratch run: its extents are mapped back to back,
+    // so the run reads as one span
+    MappedFile(const ScratchSpace& scratch, const ScratchRun& run, const SortOptions& opts = {});
+
+    // Writable view of a new file holding exactly 'count' values
+    static MappedFile create(const std::string& filename, uint64_t count);
+
+    int64_t* data() { return data_; }
+    const int64_t* data() const { return data_; }
+    uint64_t size() const { return size_; }
+    const int64_t* begin() const { return data_; }
+    const int64_t* end() const { return data_ + size_; }
+
+private:
+    MappedFile() = default;
+    void map(int fd, int prot, int flags);
+    void advise(const SortOptions& opts);
+
+    int64_t* data_ = nullptr;
+    uint64_t size_ = 0;
+    size_t mapBytes_ = 0;   // Length of the mapping (whole extents for scratch runs)
+};
+
+// Random access to single values of an int64_t file through positional reads
+class PositionalReader {
+public:
+    explicit PositionalReader(const std::string& filename);
+    PositionalReader(const ScratchSpace& scratch, const ScratchRun& run);
+    ~PositionalReader();
+    PositionalReader(PositionalReader&& other) noexcept;
+    PositionalReader(const PositionalReader&) = delete;
+    PositionalReader& operator=(const PositionalReader&) = delete;
+    PositionalReader& operator=(PositionalReader&&) = delete;
+
+    // Number of values in the file
+    uint64_t size() const { return size_; }
+
+    // Value at 'index' (must be < size())
+    int64_t at(uint64_t index) const;
+
+    // Reads up to 'count' values starting at 'index', returns how many were read
+    size_t readAt(int64_t* dst, size_t count, uint64_t index) const;
+
+private:
+    int fd_;
+    uint64_t size_;
+    const ScratchSpace* scratch_ = nullptr;
+    const ScratchRun* run_ = nullptr;
+};
+
+// Sequential reader of int64_t values that hits the disk once per buffer.
+// With depth > 1 it keeps depth - 1 buffers being read ahead on the I/O pool
+// while the current one is consumed. Reading can be limited to the values
+// with indexes in [first, last). The source is a file or a scratch run,
+// which must stay alive (and unchanged) while it is read.
+class RunReader {
+public:
+    RunReader(const std::string& filename, size_t bufferBytes, size_t depth = 1,
+              uint64_t first = 0, uint64_t last = UINT64_MAX);
+    RunReader(const ScratchSpace& scratch, const ScratchRun& run, size_t bufferBytes,
+              size_t depth = 1, uint64_t first = 0, uint64_t last = UINT64_MAX);
+    ~RunReader();
+    RunReader(RunReader&& other) noexcept;
+    RunReader(const RunReader&) = delete;
+    RunReader& operator=(const RunReader&) = delete;
+    RunReader& operator=(RunReader&&) = delete;
+
+    // Reader of a run in the packed format (run_codec.hpp): the buffers read
+    // from disk are decoded one block at a time as values are consumed
+    static RunReader packed(const std::string& filename, size_t bufferBytes,
+                            size_t depth = 1);
+    static RunReader packed(const ScratchSpace& scratch, const ScratchRun& run,
+                            size_t bufferBytes, size_t depth = 1);
+
+    // Fetches the next value, returns false at end of file
+    bool next(int64_t& value) {
+        if (pos_ == len_ && !refill()) return false;
+        value = buf_[pos_++];
+        return true;
+    }
+
+    // Reads up to 'count' values into 'dst', returns how many were read
+    size_t read(int64_t* dst, size_t count);
+
+private:
+    struct Pending {
+        IoBuffer buf;
+        std::future<size_t> bytes;
+    };
+
+    bool refill();
+    bool refillPacked();
+    size_t fetch(IoBuffer& into);
+    void prefetch(IoBuffer buf);
+    std::function<size_t()> readTask(int64_t* dst, size_t want, size_t room);
+    void usePacked();
+
+    int fd_;
+    const ScratchSpace* scratch_ = nullptr;
+    const ScratchRun* run_ = nullptr;
+    IoBuffer buf_;
+    size_t pos_ = 0, len_ = 0;
+    uint64_t offset_ = 0;   // File offset of the next read to issue
+    uint64_t end_;          // File offset where reading stops
+    bool eof_ = false;
+    std::deque<Pending> ahead_;
+    // Packed runs only: buffer as read from disk, and its undecoded bytes
+    bool packed_ = false;
+    IoBuffer raw_;
+    std::vector<unsigned char, PageAlignedAllocator<unsigned char>> pending_;
+    size_t pendingPos_ = 0;
+};
+
+// Sequential writer of int64_t values that hits the disk once per buffer.
+// With depth > 1 full buffers are written behind on the I/O pool, with up to
+// depth - 1 writes in flight. The target is a file or a scratch run, which
+// gains extents as it grows and must outlive the writer.
+class RunWriter {
+public:
+    RunWriter(const std::string& filename, size_t bufferBytes, bool append = false,
+              size_t depth = 1);
+    RunWriter(ScratchSpace& scratch, ScratchRun& run, size_t bufferBytes, size_t depth = 1);
+    ~RunWriter();
+    RunWriter(RunWriter&& other) noexcept;
+    RunWriter(const RunWriter&) = delete;
+    RunWriter& operator=(const RunWriter&) = delete;
+    RunWriter& operator=(RunWriter&& other);
+
+    // Writer into an existing file that starts at value index 'first' (no truncation)
+    static RunWriter at(const std::string& filename, size_t bufferBytes, uint64_t first,
+                        size_t depth = 1);
+
+    // Writer of a new run in the packed format; each flush encodes the buffer
+    static RunWriter packed(const std::string& filename, size_t bufferBytes,
+                            size_t depth = 1);
+    static RunWriter packed(ScratchSpace& scratch, ScratchRun& run, size_t bufferBytes,
+                            size_t depth = 1);
+
+    // Buffers one value
+    void push(int64_t value) {
+        if (len_ == buf_.size()) flush();
+        buf_[len_++] = value;
+    }
+
+    // Writes 'count' values from 'src'
+    void write(const int64_t* src, size_t count);
+
+    // Writes out buffered values
+    void flush();
+
+    // Flushes, waits for pending writes, closes the file and frees the buffers
+    // (also done by the destructor)
+    void close();
+
+private:
+    struct Pending {
+        IoBuffer buf;
+        std::future<void> done;
+    };
+
+    void flushBuffer(bool last);
+    std::function<void()> writeTask(const int64_t* src, size_t bytes, bool last);
+
+    int fd_;
+    ScratchSpace* scratch_ = nullptr;
+    ScratchRun* run_ = nullptr;
+    IoBuffer buf_;
+    size_t len_ = 0;
+    uint64_t offset_ = 0;   // File offset of the next write to issue
+    size_t depth_;
+    std::deque<Pending> behind_;
+    bool packed_ = false;
+    IoBuffer encoded_;  // Packed runs only: the buffer being written out
+};
+
+#endif
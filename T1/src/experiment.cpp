@@ -1,5 +1,7 @@
 #include "external_mergesort.hpp"
 #include "external_quicksort.hpp"
+#include "autotune.hpp"
+#include "io_stats.hpp"
 #include <algorithm>
 #include <chrono>
 #include <cstddef>
@@ -23,72 +25,21 @@ void writeBinary(const std::string &filename,
 
 using namespace std;
 
-// Contadores globales de acceso a disco
-uint64_t readCount = 0, writeCount = 0;
-size_t BLOCK_SIZE = 0;
-
-// Configuración del tamaño de bloque
-void setBlockSize(size_t blockSize) { BLOCK_SIZE = blockSize; }
-size_t getReads() { return readCount; }
-size_t getWrites() { return writeCount; }
-
-// Wrappers para contar operaciones de I/O
-vector<int64_t> readCounted(const string &f, size_t s, size_t c) {
-  auto v = readInts(f, s, c);
-  size_t bytes = v.size() * sizeof(int64_t);
-  readCount += (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  return v;
-}
-
-void appendCounted(const string &f, const vector<int64_t> &d) {
-  appendInts(f, d);
-  size_t bytes = d.size() * sizeof(int64_t);
-  writeCount += (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
-}
-
-// Búsqueda binaria de aridad óptima según 4.3.2
-int findOptimalArity(const string &filename, size_t B, size_t M) {
-  const size_t b = B / sizeof(int64_t); // Números por bloque
-  int low = 2, high = b, best_arity = 2;
-  uint64_t min_io = UINT64_MAX;
-
-  // Generar dataset de 60M si no existe
-  ifstream test(filename);
-  if (!test.good()) {
-    vector<int64_t> data(60 * 1024 * 1024 / sizeof(int64_t));
-    iota(data.begin(), data.end(), 0);
-    shuffle(data.begin(), data.end(), mt19937_64(123));
-    writeBinary(filename, data);
-  }
-
-  // Búsqueda binaria
-  while (low <= high) {
-    int mid = (low + high) / 2;
-
-    // Medir IOs para aridad actual
-    setBlockSize(B);
-    readCount = writeCount = 0;
-    try {
-      externalMergesort(filename, "temp.bin", M, mid);
-      uint64_t total_io = readCount + writeCount;
-
-      // Actualizar mejor aridad
-      if (total_io < min_io) {
-        min_io = total_io;
-        best_arity = mid;
-      }
-
-      // Reducir espacio de búsqueda
-      if (mid > best_arity)
-        high = mid - 1;
-      else
-        low = mid + 1;
-    } catch (...) {
-      high = mid - 1; // Reducir aridad si falla
-    }
-    remove("temp.bin");
-  }
-  return best_arity;
+// Bloques de disco leídos y escritos desde el último resetIoStats(), según
+// la instrumentación de disk_io
+uint64_t getReads() { return ioTotals().read.blocks; }
+uint64_t getWrites() { return ioTotals().write.blocks; }
+
+// Aridad y particiones óptimas según el modelo de costos (autotune), evaluado
+// para un dataset de 60MB con el perfil del dispositivo medido una vez y guardado
+SortPlan findOptimalPlan(size_t B, size_t M) {
+  DeviceProfile profile = loadOrMeasureProfile("device_profile.txt", ".", B);
+  SortPlan plan = planSort(profile, 60 * 1024 * 1024 / sizeof(int64_t), M, B);
+  cout << "Modelo: aridad " << plan.arity << " (" << plan.mergePasses
+       << " pasadas, buffer " << plan.mergeBufferBytes << " B, "
+       << plan.mergesortSeconds << " s), particiones " << plan.parts << " ("
+       << plan.quicksortSeconds << " s)\n";
+  return plan;
 }
 
 int main(int argc, char **argv) {
@@ -103,10 +54,10 @@ int main(int argc, char **argv) {
   const vector<size_t> multipliers = {4,  8,  12, 16, 20, 24, 28, 32,
                                       36, 40, 44, 48, 52, 56, 60};
 
-  // Paso 1: Determinar aridad óptima con dataset de 60M
-  const string largeFile = "60M_input.bin";
-  const int best_arity = findOptimalArity(largeFile, B, M);
-  cout << "Aridad óptima encontrada: " << best_arity << "\n";
+  // Paso 1: Determinar aridad y particiones óptimas para un dataset de 60M
+  SortPlan plan = findOptimalPlan(B, M);
+  cout << "Aridad óptima encontrada: " << plan.arity
+       << ", particiones: " << plan.parts << "\n";
 
   // Paso 2: Experimentación con aridad óptima
   ofstream res("results.csv");
@@ -127,22 +78,22 @@ int main(int argc, char **argv) {
       writeBinary(inFile, data);
 
       // Quicksort
-      setBlockSize(B);
+      resetIoStats();
       auto t0 = chrono::high_resolution_clock::now();
-      externalQuicksort(inFile, "outQ.bin", M, best_arity);
+      externalQuicksort(inFile, "outQ.bin", M, plan.parts, SortOptions{B});
       auto t1 = chrono::high_resolution_clock::now();
       sumTimeQ += chrono::duration<double, milli>(t1 - t0).count();
-      sumRQ += readCount;
-      sumWQ += writeCount;
+      sumRQ += getReads();
+      sumWQ += getWrites();
 
       // Mergesort
-      setBlockSize(B);
+      resetIoStats();
       t0 = chrono::high_resolution_clock::now();
-      externalMergesort(inFile, "outM.bin", M, best_arity);
+      externalMergesort(inFile, "outM.bin", M, plan.arity, SortOptions{B});
       t1 = chrono::high_resolution_clock::now();
       sumTimeM += chrono::duration<double, milli>(t1 - t0).count();
-      sumRM += readCount;
-      sumWM += writeCount;
+      sumRM += getReads();
+      sumWM += getWrites();
 
       // Limpieza
       remove(inFile.c_str());
@@ -157,6 +108,5 @@ int main(int argc, char **argv) {
         << (sumWM / runs) << "\n";
   }
 
-  remove(largeFile.c_str());
   return 0;
 }
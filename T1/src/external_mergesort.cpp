@@ -1,82 +1,838 @@
 #include "disk_io.hpp"
 #include "external_mergesort.hpp"
+#include "in_memory_sort.hpp"
+#include "io_stats.hpp"
+#include "loser_tree.hpp"
+#include "thread_pool.hpp"
 #include <bits/stdc++.h>
-#include <queue>
 
 using namespace std;
 
-vector<string> createInitialRuns(const string& inFile, size_t memBytes) {
-    size_t intsPerRun = max<size_t>(1, memBytes / sizeof(int64_t));
-    ifstream in(inFile, ios::binary);
-    vector<int64_t> buf(intsPerRun);
-    vector<string> runs;
-    int idx = 0;
-    while (in) {
-        in.read(reinterpret_cast<char*>(buf.data()), buf.size() * sizeof(int64_t));
-        size_t got = in.gcount() / sizeof(int64_t);
+// Intermediate runs, packed (run_codec.hpp) when opts.packRuns is set
+static RunWriter runWriter(ScratchSpace& scratch, ScratchRun& run, size_t bufBytes,
+                           size_t depth, const SortOptions& opts) {
+    return opts.packRuns ? RunWriter::packed(scratch, run, bufBytes, depth)
+                         : RunWriter(scratch, run, bufBytes, depth);
+}
+
+static RunReader runReader(const ScratchSpace& scratch, const ScratchRun& run, size_t bufBytes,
+                           size_t depth, bool packed) {
+    return packed ? RunReader::packed(scratch, run, bufBytes, depth)
+                  : RunReader(scratch, run, bufBytes, depth);
+}
+
+// Values in a buffer of what memBytes leaves after 'used' bytes of streams,
+// in whole cache lines as the arena charges them
+static size_t valuesLeft(size_t memBytes, size_t used) {
+    size_t bytes = memBytes > used ? memBytes - used : 0;
+    return max<size_t>(1, bytes / 64) * 64 / sizeof(int64_t);
+}
+
+// Run formation side of the selection in opts (top-K, key range, distinct).
+// No value above the limit-th smallest of a run can be among the limit
+// smallest overall, so every run that fills up to the limit lowers 'bound',
+// and the input is filtered against it from then on.
+struct Selection {
+    explicit Selection(const SortOptions& o) : opts(o), active(selective(o)) {}
+
+    // Compacts data[0..n) to the values that can still reach the output
+    size_t filter(int64_t* data, size_t n) const {
+        return active ? keepInRange(data, n, opts.minKey, min(opts.maxKey, bound)) : n;
+    }
+    bool accepts(int64_t v) const { return v >= opts.minKey && v <= min(opts.maxKey, bound); }
+
+    // Records a run of 'n' values ending with 'last'
+    void written(uint64_t n, int64_t last) {
+        if (opts.limit > 0 && n >= opts.limit) bound = min(bound, last);
+    }
+
+    const SortOptions& opts;
+    bool active;
+    int64_t bound = numeric_limits<int64_t>::max();
+};
+
+// Passes a sorted stream on to 'out', without repeats when opts.distinct,
+// and drops everything after opts.limit values
+class SelectedOutput {
+public:
+    SelectedOutput(RunWriter& out, const SortOptions& opts)
+        : out_(&out), distinct_(opts.distinct),
+          limit_(opts.limit > 0 ? opts.limit : numeric_limits<uint64_t>::max()) {}
+
+    // False once the limit is reached, so the producer can stop
+    bool push(int64_t v) {
+        if (count_ == limit_) return false;
+        if (distinct_ && count_ > 0 && v == last_) return true;
+        out_->push(v);
+        last_ = v;
+        return ++count_ < limit_;
+    }
+
+    // Starts over on another run
+    void reset(RunWriter& out) {
+        out_ = &out;
+        count_ = 0;
+    }
+
+    uint64_t count() const { return count_; }
+    int64_t last() const { return last_; }
+
+private:
+    RunWriter* out_;
+    bool distinct_;
+    uint64_t limit_;
+    uint64_t count_ = 0;
+    int64_t last_ = 0;
+};
+
+// Reads until 'count' selected values are in or the input ends
+static size_t readSelected(RunReader& in, int64_t* dst, size_t count, const Selection& sel) {
+    if (!sel.active) return in.read(dst, count);
+    size_t have = 0;
+    while (have < count) {
+        size_t got = in.read(dst + have, count - have);
         if (got == 0) break;
-        buf.resize(got);
-        sort(buf.begin(), buf.end());
-        string runName = inFile + "_run" + to_string(idx++);
-        ofstream out(runName, ios::binary);
-        out.write(reinterpret_cast<char*>(buf.data()), got * sizeof(int64_t));
-        runs.push_back(runName);
-        buf.resize(intsPerRun);
+        have += sel.filter(dst + have, got);
+    }
+    return have;
+}
+
+// Restores the min-heap property below 'i' in heap[0..n)
+static void siftDown(int64_t* heap, size_t n, size_t i) {
+    int64_t v = heap[i];
+    while (true) {
+        size_t c = 2 * i + 1;
+        if (c >= n) break;
+        if (c + 1 < n && heap[c + 1] < heap[c]) ++c;
+        if (heap[c] >= v) break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    heap[i] = v;
+}
+
+// Replacement selection: heap[0..h) holds the current run, heap[h..cap) the
+// values that arrived too small for it and wait for the next run.
+static vector<ScratchRun> replacementSelectionRuns(const string& inFile, size_t memBytes,
+                                                   ScratchSpace& scratch, const SortOptions& opts) {
+    size_t depth = max<size_t>(1, opts.ioDepth);
+    size_t cap = valuesLeft(memBytes, streamBytes(opts.blockBytes, depth, false, opts) +
+                                      streamBytes(opts.blockBytes, depth, opts.packRuns, opts));
+    RunReader in(inFile, opts.blockBytes, depth);
+    IoBuffer heap(cap);
+    Selection sel(opts);
+    size_t h = readSelected(in, heap.data(), cap, sel);
+    // A deque, so the run being written stays put while the next one is added
+    deque<ScratchRun> runs;
+    if (h == 0) return {};
+    heap.resize(h);
+    cap = h;
+    make_heap(heap.begin(), heap.end(), greater<int64_t>());
+
+    auto newRun = [&]() {
+        runs.push_back(scratch.newRun());
+        return runWriter(scratch, runs.back(), opts.blockBytes, depth, opts);
+    };
+    RunWriter out = newRun();
+    // A run past the limit is cut short: its remaining values are dropped
+    SelectedOutput keep(out, opts);
+    int64_t x;
+    while (in.next(x)) {
+        if (sel.active && !sel.accepts(x)) continue;
+        int64_t top = heap[0];
+        if (!sel.active) out.push(top);
+        else if (!keep.push(top)) sel.written(keep.count(), keep.last());
+        if (x >= top) {
+            heap[0] = x;
+        } else {
+            // 'x' belongs to the next run: shrink the current heap around it
+            heap[0] = heap[--h];
+            heap[h] = x;
+        }
+        siftDown(heap.data(), h, 0);
+        if (h == 0) {
+            out.close();
+            out = newRun();
+            keep.reset(out);
+            h = cap;
+            make_heap(heap.begin(), heap.begin() + h, greater<int64_t>());
+        }
+    }
+    // Drain the current run, then the leftovers form the last one
+    sortBuffer(heap.data(), h, opts.inMemorySort);
+    if (!sel.active) {
+        out.write(heap.data(), h);
+    } else {
+        for (size_t i = 0; i < h && keep.push(heap[i]); ++i) {}
+    }
+    out.close();
+    if (h < cap) {
+        sortBuffer(heap.data() + h, cap - h, opts.inMemorySort);
+        size_t n = trimSorted(heap.data() + h, cap - h, opts.limit, opts.distinct);
+        RunWriter last = newRun();
+        last.write(heap.data() + h, n);
+    }
+    return {runs.begin(), runs.end()};
+}
+
+// Sorts data[0..n) as 'slices' independent pieces on 'workers' and returns
+// the slice boundaries; the pieces are merged later while the run is written.
+static vector<size_t> sortSlices(int64_t* data, size_t n, size_t slices, ThreadPool* workers,
+                                 InMemorySort kernel) {
+    if (!workers || slices < 2) {
+        sortBuffer(data, n, kernel);
+        return {0, n};
+    }
+    vector<size_t> bounds;
+    for (size_t s = 0; s <= slices; ++s)
+        bounds.push_back(n * s / slices);
+    vector<future<void>> done;
+    for (size_t s = 0; s < slices; ++s) {
+        int64_t* lo = data + bounds[s];
+        int64_t* hi = data + bounds[s + 1];
+        done.push_back(workers->submit([lo, hi, kernel]() { sortBuffer(lo, hi - lo, kernel); }));
+    }
+    for (auto& d : done) d.get();
+    return bounds;
+}
+
+// Writes the sorted slices of 'data' as a single run, trimmed by 'sel'
+static void writeRun(ScratchSpace& scratch, ScratchRun& run, const int64_t* data,
+                     const vector<size_t>& bounds, const SortOptions& opts, Selection& sel) {
+    RunWriter out = runWriter(scratch, run, opts.blockBytes, 1, opts);
+    if (bounds.size() == 2 && !sel.active) {
+        out.write(data + bounds[0], bounds[1] - bounds[0]);
+    } else {
+        vector<SpanSource> slices;
+        for (size_t s = 0; s + 1 < bounds.size(); ++s)
+            slices.emplace_back(data + bounds[s], data + bounds[s + 1]);
+        LoserTree<SpanSource> tree(slices);
+        SelectedOutput keep(out, opts);
+        int64_t v;
+        if (!sel.active) {
+            while (tree.next(v))
+                out.push(v);
+        } else {
+            while (tree.next(v) && keep.push(v)) {}
+            sel.written(keep.count(), keep.last());
+        }
+    }
+    out.close();
+}
+
+// Pipelined run formation: memory is split in two halves, and while one half
+// is sorted (in parallel slices when threads > 1) the I/O pool merges and
+// writes the previous run out of the other half and refills it.
+static vector<ScratchRun> pipelinedRuns(const string& inFile, size_t memBytes,
+                                        ScratchSpace& scratch, const SortOptions& opts) {
+    // One run is written at a time, next to the input stream
+    size_t streams = streamBytes(opts.blockBytes, 1, false, opts) +
+                     streamBytes(opts.blockBytes, 1, opts.packRuns, opts);
+    size_t intsPerRun = valuesLeft(memBytes / 2, streams / 2);
+    // Only ever used by one task at a time: each read is submitted after the previous one ended
+    RunReader in(inFile, opts.blockBytes);
+    IoBuffer bufs[2] = {IoBuffer(intsPerRun), IoBuffer(intsPerRun)};
+    Selection sel(opts);
+    deque<ScratchRun> runs;
+    ThreadPool& pool = ioThreadPool();
+    size_t threads = max<size_t>(1, opts.threads);
+    unique_ptr<ThreadPool> workers;
+    if (threads > 1) workers = make_unique<ThreadPool>(threads);
+
+    size_t got = readSelected(in, bufs[0].data(), intsPerRun, sel);
+    int64_t* other = bufs[1].data();
+    future<size_t> pending = pool.submit([&in, &sel, other, intsPerRun]() {
+        return readSelected(in, other, intsPerRun, sel);
+    });
+    int cur = 0;
+    while (got > 0) {
+        auto bounds = sortSlices(bufs[cur].data(), got, threads, workers.get(),
+                                 opts.inMemorySort);
+        size_t nextGot = pending.get();
+        runs.push_back(scratch.newRun());
+        int64_t* data = bufs[cur].data();
+        pending = pool.submit([&in, &opts, &scratch, &sel, &run = runs.back(), data, bounds,
+                               intsPerRun]() {
+            writeRun(scratch, run, data, bounds, opts, sel);
+            return readSelected(in, data, intsPerRun, sel);
+        });
+        cur ^= 1;
+        got = nextGot;
+    }
+    pending.get();
+    return {runs.begin(), runs.end()};
+}
+
+// Natural runs: the ascending and descending stretches of each M-sized
+// chunk become runs, so sorted input becomes a single run.
+static vector<ScratchRun> naturalRuns(const string& inFile, size_t memBytes,
+                                      ScratchSpace& scratch, const SortOptions& opts) {
+    size_t cap = max<size_t>(2, valuesLeft(memBytes, streamBytes(opts.blockBytes, 1, false, opts) +
+                                                     streamBytes(opts.blockBytes, 1, opts.packRuns, opts)));
+    size_t minRun = max<size_t>(1, cap / 8);
+    // Packed runs are all decoded alike, so with packRuns nothing stays in
+    // place, nor with a selection, which in-place runs could not apply
+    Selection sel(opts);
+    bool inPlace = !opts.packRuns && !sel.active;
+    uint32_t source = inPlace ? scratch.addSource(inFile) : 0;
+    RunReader in(inFile, opts.blockBytes);
+    IoBuffer buf(cap);
+    deque<ScratchRun> runs;
+
+    // Open in-place run: input values [rangeBegin, rangeEnd)
+    bool rangeOpen = false;
+    uint64_t rangeBegin = 0, rangeEnd = 0;
+    int64_t rangeLast = 0;
+    auto closeRange = [&]() {
+        if (rangeOpen)
+            runs.push_back(scratch.inPlace(source, rangeBegin * sizeof(int64_t),
+                                           (rangeEnd - rangeBegin) * sizeof(int64_t)));
+        rangeOpen = false;
+    };
+    // Open written run, extended by sorted blocks that continue it
+    unique_ptr<RunWriter> out;
+    unique_ptr<SelectedOutput> keep;
+    int64_t outLast = 0;
+    auto emitSorted = [&](const int64_t* data, size_t n) {
+        if (n == 0) return;
+        // Appended to the open run when it starts at or above its last value
+        if (!out || data[0] < outLast) {
+            // The finished run's buffers go before the next run's are taken
+            if (out) out->close();
+            out.reset();
+            runs.push_back(scratch.newRun());
+            out = make_unique<RunWriter>(runWriter(scratch, runs.back(), opts.blockBytes, 1, opts));
+            keep = make_unique<SelectedOutput>(*out, opts);
+        }
+        if (!sel.active) {
+            out->write(data, n);
+        } else {
+            for (size_t i = 0; i < n && keep->push(data[i]); ++i) {}
+            sel.written(keep->count(), keep->last());
+        }
+        outLast = data[n - 1];
+    };
+
+    uint64_t base = 0;      // Input position of buf[0]
+    size_t carry = 0;       // Values held over from the previous chunk
+    while (true) {
+        size_t got = readSelected(in, buf.data() + carry, cap - carry, sel);
+        size_t n = carry + got;
+        bool atEnd = got < cap - carry;
+        size_t rest = 0;    // Short stretches are gathered in buf[0, rest)
+        size_t i = 0;
+        while (i < n) {
+            size_t j = i + 1;
+            bool descending = j < n && buf[j] < buf[j - 1];
+            if (descending) {
+                while (j < n && buf[j] < buf[j - 1]) ++j;
+            } else {
+                while (j < n && buf[j] >= buf[j - 1]) ++j;
+            }
+            // A short stretch at the end may go on in the next chunk
+            if (j == n && !atEnd && j - i < minRun) break;
+            bool continues = !descending && rangeOpen && rangeEnd == base + i && buf[i] >= rangeLast;
+            if (j - i < minRun && !continues) {
+                // Short stretches are sorted together after the chunk
+                memmove(buf.data() + rest, buf.data() + i, (j - i) * sizeof(int64_t));
+                rest += j - i;
+            } else if (descending) {
+                // Reversed into an ascending run
+                reverse(buf.begin() + i, buf.begin() + j);
+                emitSorted(buf.data() + i, j - i);
+            } else if (inPlace) {
+                // Not copied: the merge reads it from the input, and a stretch
+                // right after the previous one extends it, across chunks too.
+                // Sorted input is thus read twice with no write before the
+                // final copy.
+                if (!continues) {
+                    closeRange();
+                    rangeOpen = true;
+                    rangeBegin = base + i;
+                }
+                rangeEnd = base + j;
+                rangeLast = buf[j - 1];
+            } else {
+                emitSorted(buf.data() + i, j - i);
+            }
+            i = j;
+        }
+        sortBuffer(buf.data(), rest, opts.inMemorySort);
+        emitSorted(buf.data(), rest);
+        carry = n - i;
+        memmove(buf.data(), buf.data() + i, carry * sizeof(int64_t));
+        base += i;
+        if (atEnd) break;
+    }
+    closeRange();
+    if (out) out->close();
+    return {runs.begin(), runs.end()};
+}
+
+vector<ScratchRun> createInitialRuns(const string& inFile, size_t memBytes,
+                                     ScratchSpace& scratch, const SortOptions& opts) {
+    PhaseScope phase("run formation");
+    if (opts.runFormation == RunFormation::ReplacementSelection)
+        return replacementSelectionRuns(inFile, memBytes, scratch, opts);
+    if (opts.runFormation == RunFormation::Natural)
+        return naturalRuns(inFile, memBytes, scratch, opts);
+    if (opts.ioDepth > 1 || opts.threads > 1)
+        return pipelinedRuns(inFile, memBytes, scratch, opts);
+    size_t intsPerRun = valuesLeft(memBytes, streamBytes(opts.blockBytes, 1, false, opts) +
+                                             streamBytes(opts.blockBytes, 1, opts.packRuns, opts));
+    RunReader in(inFile, opts.blockBytes);
+    IoBuffer buf(intsPerRun);
+    vector<ScratchRun> runs;
+    Selection sel(opts);
+    while (true) {
+        size_t got = readSelected(in, buf.data(), buf.size(), sel);
+        if (got == 0) break;
+        sortBuffer(buf.data(), got, opts.inMemorySort);
+        if (sel.active) {
+            got = trimSorted(buf.data(), got, opts.limit, opts.distinct);
+            sel.written(got, buf[got - 1]);
+        }
+        runs.push_back(scratch.newRun());
+        RunWriter out = runWriter(scratch, runs.back(), opts.blockBytes, 1, opts);
+        out.write(buf.data(), got);
     }
     return runs;
 }
 
-void mergeRuns(vector<string>& runFiles, size_t /*memBytes*/, int arity) {
-    int pass = 0;
-    while (runFiles.size() > 1) {
-        vector<string> next;
-        for (size_t i = 0; i < runFiles.size(); i += arity) {
-            size_t end = min(i + arity, runFiles.size());
-            vector<ifstream> ins;
-            for (size_t j = i; j < end; ++j)
-                ins.emplace_back(runFiles[j], ios::binary);
-            string outName = runFiles[i] + "_m" + to_string(pass);
-            ofstream out(outName, ios::binary);
-            using P = pair<int64_t,int>;
-            auto cmp = [](const P &a, const P &b){ return a.first > b.first; };
-            priority_queue<P, vector<P>, decltype(cmp)> pq(cmp);
-            // initial load
-            for (size_t k = 0; k < ins.size(); ++k) {
-                int64_t x;
-                if (ins[k].read(reinterpret_cast<char*>(&x), sizeof(x)))
-                    pq.emplace(x, k);
+// Merges runs[first, last) within 'memBytes' into 'outRun', packed if
+// 'packOut', or into the final 'outFile' when outRun is null. The input
+// extents are released as soon as the group is merged.
+static void mergeGroup(ScratchSpace& scratch, const vector<ScratchRun>& runs, size_t first,
+                       size_t last, bool packedIn, ScratchRun* outRun, bool packOut,
+                       const string& outFile, size_t memBytes, const SortOptions& opts) {
+    // The input streams plus one output stream share the memory,
+    // each with 'ioDepth' buffers
+    size_t depth = max<size_t>(1, opts.ioDepth);
+    size_t bufBytes = streamBuffer(memBytes, last - first + 1, depth, packedIn || packOut, opts);
+    {
+        vector<RunReader> ins;
+        ins.reserve(last - first);
+        for (size_t j = first; j < last; ++j)
+            ins.push_back(runReader(scratch, runs[j], bufBytes, depth, packedIn));
+        RunWriter out = !outRun ? RunWriter(outFile, bufBytes, false, depth)
+                      : packOut ? RunWriter::packed(scratch, *outRun, bufBytes, depth)
+                                : RunWriter(scratch, *outRun, bufBytes, depth);
+        // k-way merge through a loser tree; every pass drops repeats and
+        // stops at the limit, since the group's output needs no more
+        LoserTree<RunReader> tree(ins);
+        int64_t val;
+        if (!opts.distinct && opts.limit == 0) {
+            while (tree.next(val))
+                out.push(val);
+        } else {
+            SelectedOutput keep(out, opts);
+            while (tree.next(val) && keep.push(val)) {}
+        }
+        out.close();
+    }
+    for (size_t j = first; j < last; ++j)
+        scratch.release(runs[j]);
+}
+
+// Per-run positions that split the merged output at global rank 'rank': the
+// first 'rank' merged values are exactly runs[j][0, pos[j]) over all j.
+static vector<uint64_t> splitAtRank(const vector<PositionalReader>& runs, uint64_t rank) {
+    // The value of rank 'rank' lies in some runs[j][lo[j], hi[j]): what is
+    // before lo[j] is smaller and what is from hi[j] on is larger
+    vector<uint64_t> lo(runs.size(), 0), hi(runs.size()), below(runs.size()), upTo(runs.size());
+    uint64_t total = 0;
+    for (size_t j = 0; j < runs.size(); ++j) {
+        hi[j] = runs[j].size();
+        total += hi[j];
+    }
+    if (rank >= total) return hi;
+    // Values < v (strict) or <= v (inclusive) in run j, by binary search on disk
+    auto countBelow = [&](size_t j, int64_t v, bool inclusive) {
+        uint64_t a = lo[j], b = hi[j];
+        while (a < b) {
+            uint64_t mid = a + (b - a) / 2;
+            int64_t x = runs[j].at(mid);
+            if (x < v || (inclusive && x == v)) a = mid + 1;
+            else b = mid;
+        }
+        return a;
+    };
+    // Candidates are the middle values of the widest remaining range, which
+    // shrinks by half or more each round
+    while (true) {
+        size_t widest = 0;
+        for (size_t j = 1; j < runs.size(); ++j)
+            if (hi[j] - lo[j] > hi[widest] - lo[widest]) widest = j;
+        int64_t v = runs[widest].at(lo[widest] + (hi[widest] - lo[widest]) / 2);
+        uint64_t less = 0, notMore = 0;
+        for (size_t j = 0; j < runs.size(); ++j) {
+            below[j] = countBelow(j, v, false);
+            upTo[j] = countBelow(j, v, true);
+            less += below[j];
+            notMore += upTo[j];
+        }
+        if (rank < less) {
+            hi = below;
+        } else if (rank >= notMore) {
+            lo = upTo;
+        } else {
+            break;
+        }
+    }
+    // Everything below v goes left; copies of v fill up the remainder in run order
+    uint64_t left = rank;
+    for (size_t j = 0; j < runs.size(); ++j) left -= below[j];
+    for (size_t j = 0; j < runs.size() && left > 0; ++j) {
+        uint64_t take = min(upTo[j] - below[j], left);
+        below[j] += take;
+        left -= take;
+    }
+    return below;
+}
+
+// Final merge split by key range: each worker merges the slice of every run
+// that lands in its share of the output and writes it at its final offset.
+static void parallelFinalMerge(ScratchSpace& scratch, const vector<ScratchRun>& runFiles,
+                               const string& outName, size_t memBytes, const SortOptions& opts,
+                               ThreadPool& workers) {
+    vector<PositionalReader> runs;
+    uint64_t total = 0;
+    for (auto& f : runFiles) {
+        runs.emplace_back(scratch, f);
+        total += runs.back().size();
+    }
+    size_t t = workers.size();
+    vector<vector<uint64_t>> cuts(t + 1);
+    cuts[0].assign(runs.size(), 0);
+    for (size_t s = 1; s < t; ++s)
+        cuts[s] = splitAtRank(runs, total * s / t);
+    for (auto& r : runs) cuts[t].push_back(r.size());
+
+    preallocateFile(outName, total * sizeof(int64_t));
+    size_t depth = max<size_t>(1, opts.ioDepth);
+    size_t bufBytes = streamBuffer(memBytes / t, runs.size() + 1, depth, false, opts);
+    vector<future<void>> done;
+    for (size_t s = 0; s < t; ++s) {
+        done.push_back(workers.submit([&, s]() {
+            vector<RunReader> ins;
+            ins.reserve(runs.size());
+            for (size_t j = 0; j < runs.size(); ++j)
+                ins.emplace_back(scratch, runFiles[j], bufBytes, depth, cuts[s][j], cuts[s + 1][j]);
+            RunWriter out = RunWriter::at(outName, bufBytes, total * s / t, depth);
+            LoserTree<RunReader> tree(ins);
+            int64_t val;
+            while (tree.next(val))
+                out.push(val);
+            out.close();
+        }));
+    }
+    for (auto& d : done) d.get();
+    for (auto& r : runFiles)
+        scratch.release(r);
+}
+
+// Memory of a merge of 'k' runs with one-block streams
+static size_t mergeBytes(size_t k, bool packed, const SortOptions& opts) {
+    return (k + 1) * streamBytes(opts.blockBytes, opts.ioDepth, packed, opts);
+}
+
+// Widest merge, up to 'arity', whose streams fit memBytes (at least 2 ways)
+static int fittingArity(int arity, size_t memBytes, const SortOptions& opts) {
+    size_t k = max<size_t>(2, arity);
+    while (k > 2 && mergeBytes(k, opts.packRuns, opts) > memBytes) --k;
+    return static_cast<int>(k);
+}
+
+// Orders runs into the groups of a pass ('arity' runs, the last one maybe
+// fewer) and returns the empty output run of each. With several scratch
+// files, the outputs go round-robin and every group reads from other files
+// than its output's: it takes its runs from the files with the most left,
+// which keeps its reads spread over the remaining devices.
+static vector<ScratchRun> stripeGroups(vector<ScratchRun>& runs, size_t arity,
+                                       ScratchSpace& scratch) {
+    size_t groups = (runs.size() + arity - 1) / arity;
+    vector<ScratchRun> outs;
+    outs.reserve(groups);
+    if (scratch.files() < 2) {
+        for (size_t g = 0; g < groups; ++g) outs.push_back(scratch.newRun());
+        return outs;
+    }
+    // Runs read in place count as a file of their own
+    map<uint32_t, deque<ScratchRun>> byFile;
+    for (auto& run : runs) byFile[run.file].push_back(std::move(run));
+    vector<ScratchRun> ordered;
+    ordered.reserve(runs.size());
+    for (size_t g = 0; g < groups; ++g) {
+        outs.push_back(scratch.newRun());
+        uint32_t out = outs.back().file;
+        size_t want = min(arity, runs.size() - g * arity);
+        for (size_t k = 0; k < want; ++k) {
+            auto pick = byFile.end();
+            for (auto it = byFile.begin(); it != byFile.end(); ++it) {
+                if (it->second.empty()) continue;
+                if (pick == byFile.end()) {
+                    pick = it;
+                    continue;
+                }
+                bool apart = it->first != out, pickApart = pick->first != out;
+                if (apart > pickApart || (apart == pickApart && it->second.size() > pick->second.size()))
+                    pick = it;
             }
-            // k-way merge
-            while (!pq.empty()) {
-                auto [val, idx] = pq.top(); pq.pop();
-                out.write(reinterpret_cast<char*>(&val), sizeof(val));
-                int64_t x;
-                if (ins[idx].read(reinterpret_cast<char*>(&x), sizeof(x)))
-                    pq.emplace(x, idx);
+            ordered.push_back(std::move(pick->second.front()));
+            pick->second.pop_front();
+        }
+    }
+    runs.swap(ordered);
+    return outs;
+}
+
+// Intermediate passes: merges groups of 'arity' runs into new scratch runs
+// until at most 'arity' are left for the final merge. 'packed' tells
+// whether the runs are packed, 'pass' numbers the passes.
+static void reduceRuns(vector<ScratchRun>& runs, bool& packed, int& pass, size_t memBytes,
+                       int arity, ScratchSpace& scratch, const SortOptions& opts) {
+    size_t threads = max<size_t>(1, opts.threads);
+    while (runs.size() > static_cast<size_t>(arity)) {
+        PhaseScope phase("merge pass " + to_string(pass++));
+        vector<ScratchRun> next = stripeGroups(runs, arity, scratch);
+        size_t groups = next.size();
+        // Independent groups are merged concurrently, splitting M between
+        // them, as many as M holds the streams of
+        size_t fit = memBytes / mergeBytes(arity, packed || opts.packRuns, opts);
+        size_t active = max<size_t>(1, min({threads, groups, fit}));
+        unique_ptr<ThreadPool> workers;
+        if (active > 1) workers = make_unique<ThreadPool>(active);
+        vector<future<void>> done;
+        for (size_t g = 0; g < groups; ++g) {
+            size_t i = g * arity, end = min(i + arity, runs.size());
+            ScratchRun* out = &next[g];
+            if (!workers) {
+                mergeGroup(scratch, runs, i, end, packed, out, opts.packRuns, "", memBytes, opts);
+                continue;
             }
-            // cleanup
-            for (size_t j = i; j < end; ++j)
-                remove(runFiles[j].c_str());
-            next.push_back(outName);
+            done.push_back(workers->submit([&, i, end, out]() {
+                mergeGroup(scratch, runs, i, end, packed, out, opts.packRuns, "",
+                           memBytes / active, opts);
+            }));
         }
-        runFiles.swap(next);
-        ++pass;
+        for (auto& d : done) d.get();
+        runs.swap(next);
+        packed = opts.packRuns;
+    }
+}
+
+void mergeRuns(vector<ScratchRun>& runs, const string& outFile, size_t memBytes, int arity,
+               ScratchSpace& scratch, const SortOptions& opts) {
+    if (runs.empty()) {
+        ofstream(outFile, ios::binary).close();
+        return;
     }
+    bool packed = opts.packRuns;
+    int pass = 0;
+    arity = fittingArity(arity, memBytes, opts);
+    reduceRuns(runs, packed, pass, memBytes, arity, scratch, opts);
+    // The final pass, also for a single run, writes outFile. The key-range
+    // split needs random access, which packed runs lack, and output offsets
+    // known in advance, which distinct values and a limit do not give.
+    PhaseScope phase("merge pass " + to_string(pass));
+    size_t threads = min<size_t>(max<size_t>(1, opts.threads),
+                                 memBytes / mergeBytes(runs.size(), false, opts));
+    if (threads > 1 && !packed && runs.size() > 1 && !opts.distinct && opts.limit == 0) {
+        ThreadPool workers(threads);
+        parallelFinalMerge(scratch, runs, outFile, memBytes, opts, workers);
+    } else {
+        mergeGroup(scratch, runs, 0, runs.size(), packed, nullptr, false, outFile, memBytes, opts);
+    }
+    runs.clear();
+}
+
+// Memory of the input and output streams of topKInMemory
+static size_t topKStreams(const SortOptions& opts) {
+    return streamBytes(opts.blockBytes, opts.ioDepth, false, opts) +
+           streamBytes(opts.blockBytes, 1, false, opts);
+}
+
+// Top-K that fits in memory: selected values gather in a buffer of at least
+// 2K values. Whenever it fills, it is cut back to its K smallest (to its K
+// smallest distinct ones when opts.distinct), and the K-th becomes the bound
+// that filters the rest of the input. One read of the input and no runs.
+static void topKInMemory(const string& inFile, const string& outFile, size_t memBytes,
+                         const SortOptions& opts) {
+    size_t k = opts.limit;
+    size_t cap = max<size_t>(2 * k, valuesLeft(memBytes, topKStreams(opts)));
+    RunReader in(inFile, opts.blockBytes, max<size_t>(1, opts.ioDepth));
+    IoBuffer buf(cap);
+    Selection sel(opts);
+    size_t n = 0;
+    while (true) {
+        n += readSelected(in, buf.data() + n, cap - n, sel);
+        if (n < cap) break;
+        if (opts.distinct) {
+            sortBuffer(buf.data(), n, opts.inMemorySort);
+            n = trimSorted(buf.data(), n, k, true);
+        } else {
+            nth_element(buf.begin(), buf.begin() + (k - 1), buf.begin() + n);
+            n = k;
+        }
+        // Fewer than K distinct values so far leave the bound open
+        if (n == k) sel.bound = min(sel.bound, *max_element(buf.begin(), buf.begin() + n));
+    }
+    sortBuffer(buf.data(), n, opts.inMemorySort);
+    n = trimSorted(buf.data(), n, k, opts.distinct);
+    RunWriter out(outFile, opts.blockBytes);
+    out.write(buf.data(), n);
+    out.close();
 }
 
 void externalMergesort(const string& inFile,
                        const string& outFile,
                        size_t memBytes,
-                       int arity) {
+                       int arity,
+                       const SortOptions& opts) {
+    setIoBlockBytes(opts.blockBytes);
     if (::getFileSize<int64_t>(inFile) <= memBytes) {
-        sortInMemory(inFile, outFile);
+        PhaseScope phase("in-memory sort");
+        sortInMemory(inFile, outFile, opts);
         return;
     }
-    auto runs = createInitialRuns(inFile, memBytes);
-    mergeRuns(runs, memBytes, arity);
-    if (!runs.empty()) {
-        rename(runs[0].c_str(), outFile.c_str());
-    } else {
-        ofstream(outFile, ios::binary).close();
+    // Every buffer from here on is carved out of M
+    MemoryArena arena(sortBudget(memBytes, opts));
+    ArenaScope charged(&arena);
+    memBytes = arena.limit();
+    if (opts.limit > 0 && opts.limit <= valuesLeft(memBytes, topKStreams(opts)) / 2) {
+        PhaseScope phase("top-k");
+        topKInMemory(inFile, outFile, memBytes, opts);
+        return;
     }
+    ScratchSpace scratch = ScratchSpace::forSort(inFile, memBytes, opts);
+    auto runs = createInitialRuns(inFile, memBytes, scratch, opts);
+    mergeRuns(runs, outFile, memBytes, arity, scratch, opts);
+}
+
+struct SortedStream::State {
+    unique_ptr<MemoryArena> arena;  // Holds every buffer below, so it goes last
+    IoBuffer memory;            // Everything, when it never left memory
+    size_t pos = 0;
+    unique_ptr<ScratchSpace> scratch;
+    vector<ScratchRun> runs;
+    vector<RunReader> ins;
+    unique_ptr<LoserTree<RunReader>> tree;
+    // Selection of the final merge, applied as values are pulled
+    bool distinct = false;
+    uint64_t left = numeric_limits<uint64_t>::max();
+    bool any = false;
+    int64_t last = 0;
+};
+
+SortedStream::SortedStream(unique_ptr<State> state) : state_(std::move(state)) {}
+SortedStream::SortedStream(SortedStream&& other) noexcept = default;
+SortedStream& SortedStream::operator=(SortedStream&& other) noexcept = default;
+SortedStream::~SortedStream() = default;
+
+bool SortedStream::next(int64_t& value) {
+    State& s = *state_;
+    if (s.tree) {
+        if (s.left == 0) return false;
+        while (s.tree->next(value)) {
+            if (s.distinct && s.any && value == s.last) continue;
+            s.any = true;
+            s.last = value;
+            --s.left;
+            return true;
+        }
+        return false;
+    }
+    if (s.pos == s.memory.size()) return false;
+    value = s.memory[s.pos++];
+    return true;
+}
+
+size_t SortedStream::read(int64_t* dst, size_t count) {
+    State& s = *state_;
+    if (!s.tree) {
+        size_t n = min(count, s.memory.size() - s.pos);
+        copy(s.memory.begin() + s.pos, s.memory.begin() + s.pos + n, dst);
+        s.pos += n;
+        return n;
+    }
+    size_t got = 0;
+    while (got < count && next(dst[got])) ++got;
+    return got;
+}
+
+StreamingSorter::StreamingSorter(size_t memBytes, int arity, const SortOptions& opts)
+    : arena_(make_unique<MemoryArena>(sortBudget(memBytes, opts))),
+      memBytes_(arena_->limit()), arity_(fittingArity(arity, memBytes_, opts)), opts_(opts) {
+    setIoBlockBytes(opts.blockBytes);
+    ArenaScope charged(arena_.get());
+    // Pushed values fill what the writer of a spill leaves
+    buf_ = IoBuffer();
+    buf_.reserve(valuesLeft(memBytes_, streamBytes(opts.blockBytes, 1, opts.packRuns, opts)));
+    if (opts.threads > 1) workers_ = make_unique<ThreadPool>(opts.threads);
+}
+
+StreamingSorter::~StreamingSorter() = default;
+
+void StreamingSorter::push(const int64_t* values, size_t count) {
+    ArenaScope charged(arena_.get());
+    while (count > 0) {
+        size_t n = min(count, buf_.capacity() - buf_.size());
+        size_t at = buf_.size();
+        buf_.insert(buf_.end(), values, values + n);
+        if (selective(opts_))
+            buf_.resize(at + keepInRange(buf_.data() + at, n, opts_.minKey, min(opts_.maxKey, bound_)));
+        values += n;
+        count -= n;
+        if (buf_.size() == buf_.capacity()) spill();
+    }
+}
+
+// Sorts the buffered values and writes them as a new run
+void StreamingSorter::spill() {
+    PhaseScope phase("run formation");
+    ArenaScope charged(arena_.get());
+    if (!scratch_) {
+        scratch_ = make_unique<ScratchSpace>(ScratchSpace::dirsFor("-", opts_), ScratchSpace::extentBytesFor(memBytes_), 0,
+                                             opts_.directIo);
+    }
+    size_t threads = max<size_t>(1, opts_.threads);
+    auto bounds = sortSlices(buf_.data(), buf_.size(), threads, workers_.get(), opts_.inMemorySort);
+    runs_.push_back(scratch_->newRun());
+    Selection sel(opts_);
+    sel.bound = bound_;
+    writeRun(*scratch_, runs_.back(), buf_.data(), bounds, opts_, sel);
+    bound_ = sel.bound;
+    buf_.clear();
+}
+
+SortedStream StreamingSorter::finish() {
+    ArenaScope charged(arena_.get());
+    auto state = make_unique<SortedStream::State>();
+    state->arena = std::move(arena_);
+    if (!scratch_) {
+        // Never spilled: sort in place and serve from memory
+        sortBuffer(buf_.data(), buf_.size(), opts_.inMemorySort);
+        buf_.resize(trimSorted(buf_.data(), buf_.size(), opts_.limit, opts_.distinct));
+        state->memory = std::move(buf_);
+        return SortedStream(std::move(state));
+    }
+    if (!buf_.empty()) spill();
+    buf_ = IoBuffer();              // The merge buffers get all of M
+    workers_.reset();
+    bool packed = opts_.packRuns;
+    int pass = 0;
+    reduceRuns(runs_, packed, pass, memBytes_, arity_, *scratch_, opts_);
+
+    // Final merge without an output stream: its buffers go to the inputs
+    state->scratch = std::move(scratch_);
+    state->runs = std::move(runs_);
+    size_t depth = max<size_t>(1, opts_.ioDepth);
+    size_t bufBytes = streamBuffer(memBytes_, state->runs.size(), depth, packed, opts_);
+    state->ins.reserve(state->runs.size());
+    for (auto& run : state->runs)
+        state->ins.push_back(runReader(*state->scratch, run, bufBytes, depth, packed));
+    state->tree = make_unique<LoserTree<RunReader>>(state->ins);
+    state->distinct = opts_.distinct;
+    if (opts_.limit > 0) state->left = opts_.limit;
+    return SortedStream(std::move(state));
 }
@@ -3,32 +3,87 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <memory>
 #include <vector>
 #include <string>
+#include "disk_io.hpp"
+#include "scratch.hpp"
+#include "sort_options.hpp"
 
-// Returns file size in bytes
-template<typename T>
-size_t getFileSize(const std::string& filename);
+// Creates sorted runs in 'scratch' as opts.runFormation says and returns
+// them. Natural runs may be read in place from 'inFile' by the merge, so
+// the input must stay unchanged (and be another file than the output).
+std::vector<ScratchRun> createInitialRuns(const std::string& inFile, size_t memBytes,
+                                          ScratchSpace& scratch, const SortOptions& opts = {});
 
-// Reads up to 'count' int64_t values starting from 'start' index
-std::vector<int64_t> readInts(const std::string& filename, size_t start, size_t count);
-
-// Appends values to a binary file
-void appendInts(const std::string& filename, const std::vector<int64_t>& data);
-
-// Sorts a small file entirely in memory
-void sortInMemory(const std::string& inFile, const std::string& outFile);
-
-// Creates sorted runs of size <= memBytes and returns their filenames
-std::vector<std::string> createInitialRuns(const std::string& inFile, size_t memBytes);
-
-// Merges runs in multiple passes using up to 'arity' runs per merge
-void mergeRuns(std::vector<std::string>& runFiles, size_t memBytes, int arity);
+// Merges runs in multiple passes using up to 'arity' runs per merge; the
+// last pass writes 'outFile'. The extents of merged runs are reused by the
+// following passes, and 'runs' ends up empty.
+void mergeRuns(std::vector<ScratchRun>& runs, const std::string& outFile, size_t memBytes,
+               int arity, ScratchSpace& scratch, const SortOptions& opts = {});
 
 // The main external mergesort function
 void externalMergesort(const std::string& inFile,
                        const std::string& outFile,
                        size_t memBytes,
-                       int arity);
+                       int arity,
+                       const SortOptions& opts = {});
+
+class ThreadPool;
+
+// Sorted output of a StreamingSorter, pulled value by value: the final
+// merge runs lazily as values are consumed, and no output file is written.
+// It owns the scratch space holding the runs.
+class SortedStream {
+public:
+    SortedStream(SortedStream&& other) noexcept;
+    SortedStream& operator=(SortedStream&& other) noexcept;
+    ~SortedStream();
+
+    // Fetches the next value, returns false once every value was pulled
+    bool next(int64_t& value);
+
+    // Reads up to 'count' values into 'dst', returns how many were read
+    size_t read(int64_t* dst, size_t count);
+
+private:
+    friend class StreamingSorter;
+    struct State;
+    explicit SortedStream(std::unique_ptr<State> state);
+    std::unique_ptr<State> state_;
+};
+
+// External mergesort fed by pushes instead of an input file. Pushed values
+// fill M; each full M is sorted and spilled as a run to scratch space
+// (opts.scratchDirs, or the current directory, created at the first spill).
+// finish() merges down to at most 'arity' runs and hands back the stream
+// that merges those. Input that fits in M never touches the disk. The
+// selection in opts (limit, key range, distinct) applies as in the file sorts.
+class StreamingSorter {
+public:
+    StreamingSorter(size_t memBytes, int arity, const SortOptions& opts = {});
+    ~StreamingSorter();
+    StreamingSorter(const StreamingSorter&) = delete;
+    StreamingSorter& operator=(const StreamingSorter&) = delete;
+
+    void push(const int64_t* values, size_t count);
+    void push(const std::vector<int64_t>& values) { push(values.data(), values.size()); }
+
+    // Ends the input; the sorter must not be used afterwards
+    SortedStream finish();
+
+private:
+    void spill();
+
+    std::unique_ptr<MemoryArena> arena_;    // Budget of the buffers below, so it goes last
+    size_t memBytes_;
+    int arity_;
+    SortOptions opts_;
+    IoBuffer buf_;
+    std::unique_ptr<ScratchSpace> scratch_;
+    std::vector<ScratchRun> runs_;
+    std::unique_ptr<ThreadPool> workers_;
+    int64_t bound_ = INT64_MAX;     // Top-K bound from the runs written so far
+};
 
 #endif // EXTERNAL_MERGESORT_HPP
\ No newline at end of file
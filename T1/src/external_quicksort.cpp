@@ -1,78 +1,424 @@
 #include "external_quicksort.hpp"
 #include "disk_io.hpp"
+#include "in_memory_sort.hpp"
+#include "io_stats.hpp"
+#include "thread_pool.hpp"
 #include <bits/stdc++.h>
-#include <ctime>
 
 using namespace std;
 
-// Chooses pivots using reservoir sampling
-vector<int64_t> choosePivots(const string& filename, size_t memBytes, int parts) {
-    size_t total = getFileSize<int64_t>(filename) / sizeof(int64_t); // Fixed template arg
-    size_t samp = memBytes / sizeof(int64_t);
-    if (samp > total) samp = total;
-
-    vector<int64_t> res;
-    res.reserve(samp);
-    ifstream in(filename, ios::binary);
-    int64_t x;
-    size_t seen = 0;
-    while (in.read(reinterpret_cast<char*>(&x), sizeof(x))) {
-        ++seen;
-        if (res.size() < samp) res.push_back(x);
-        else if (rand() % seen < samp) res[rand() % samp] = x; // Fixed sign compare
-    }
-
-    sort(res.begin(), res.end());
-    vector<int64_t> pivots;
-    for (int i = 1; i < parts; ++i)
-        pivots.push_back(res[i * res.size() / parts]);
-    return pivots;
+// Small, fast generator for sampling (SplitMix64)
+class SampleRng {
+public:
+    explicit SampleRng(uint64_t seed) : state_(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, n)
+    uint64_t below(uint64_t n) { return next() % n; }
+
+    // Uniform in (0, 1)
+    double unit() { return (static_cast<double>(next() >> 11) + 0.5) * 0x1.0p-53; }
+
+private:
+    uint64_t state_;
+};
+
+// Bytes the memory arena charges for a buffer of 'bytes' (whole cache lines)
+static size_t chargedBytes(size_t bytes) {
+    return (bytes + 63) / 64 * 64;
+}
+
+// Memory of the stream a sorted leaf or an equality bucket is written with
+static size_t outputStream(const SortOptions& opts) {
+    return streamBytes(opts.blockBytes, 1, false, opts);
 }
 
-// Partitions file into parts+1 temporary files based on pivots
-void partitionFile(const string& file, const vector<int64_t>& pivots,
-                   vector<string>& outFiles, size_t memBytes) {
+// Reservoir of 'k' values over the whole mapped input with Algorithm L:
+// the gaps between replacements are drawn directly, so the skipped values
+// are never touched
+static IoBuffer reservoirSample(const MappedFile& in, size_t k, SampleRng& rng) {
+    size_t n = in.size();
+    IoBuffer res(in.begin(), in.begin() + min(k, n));
+    if (k == 0 || n <= k) return res;
+    double w = exp(log(rng.unit()) / k);
+    uint64_t i = k - 1;
+    while (true) {
+        double skip = floor(log(rng.unit()) / log1p(-w));
+        if (skip >= static_cast<double>(n - i)) break;
+        i += static_cast<uint64_t>(skip) + 1;
+        if (i >= n) break;
+        res[rng.below(k)] = in.data()[i];
+        w *= exp(log(rng.unit()) / k);
+    }
+    return res;
+}
+
+// All values of 'blocks' distinct random B-sized blocks, read in file order
+static IoBuffer blockSample(const PositionalReader& in, size_t blocks, size_t blockBytes,
+                                   SampleRng& rng) {
+    size_t perBlock = max<size_t>(1, blockBytes / sizeof(int64_t));
+    uint64_t total = (in.size() + perBlock - 1) / perBlock;
+    vector<uint64_t> picked;
+    if (blocks >= total) {
+        picked.resize(total);
+        iota(picked.begin(), picked.end(), 0);
+    } else {
+        // Floyd's algorithm: 'blocks' distinct indices without a table of all of them
+        unordered_set<uint64_t> chosen;
+        for (uint64_t j = total - blocks; j < total; ++j) {
+            uint64_t t = rng.below(j + 1);
+            chosen.insert(chosen.count(t) ? j : t);
+        }
+        picked.assign(chosen.begin(), chosen.end());
+        sort(picked.begin(), picked.end());
+    }
+    IoBuffer res(picked.size() * perBlock);
+    size_t got = 0;
+    for (uint64_t b : picked)
+        got += in.readAt(res.data() + got, perBlock, b * perBlock);
+    res.resize(got);
+    return res;
+}
+
+// Sample of 'in' for samplePivots; 'mapAll' maps the whole input when
+// every value is sampled
+template<typename MapFn>
+static PivotSample pivotsFrom(const PositionalReader& in, MapFn mapAll, size_t memBytes,
+                              int parts, const SortOptions& opts) {
+    PhaseScope phase("sampling");
+    SampleRng rng(opts.seed);
+    size_t blockBytes = max<size_t>(opts.blockBytes, sizeof(int64_t));
+    // The sample is held in memBytes as the arena charges it
+    size_t room = memBytes / 64 * 64;
+    IoBuffer res;
+    if (opts.sampleBlocks > 0) {
+        size_t blocks = min(opts.sampleBlocks, max<size_t>(1, room / blockBytes));
+        res = blockSample(in, blocks, blockBytes, rng);
+    } else {
+        res = reservoirSample(mapAll(), room / sizeof(int64_t), rng);
+    }
+    // Splitters only where values are kept, so no partition is wasted on the rest
+    res.resize(keepInRange(res.data(), res.size(), opts.minKey, opts.maxKey));
+    sortBuffer(res.data(), res.size(), opts.inMemorySort);
+
+    PivotSample out;
+    out.sampleSize = res.size();
+    if (res.empty() || parts < 2) return out;
+    // Repeated quantiles collapse into one pivot; a value that holds a
+    // partition's share of the sample gets an equality bucket, since its
+    // copies would otherwise fill a partition that never shrinks
+    for (int i = 1; i < parts; ++i) {
+        int64_t p = res[i * res.size() / parts];
+        if (!out.pivots.empty() && out.pivots.back() == p) continue;
+        auto same = equal_range(res.begin(), res.end(), p);
+        out.pivots.push_back(p);
+        out.equal.push_back(static_cast<size_t>(same.second - same.first) * parts >= res.size());
+    }
+    // Sample values per partition, routed like partitionFile routes them
+    size_t largest = 0, from = 0;
+    for (size_t i = 0; i <= out.pivots.size(); ++i) {
+        if (i == out.pivots.size()) {
+            largest = max(largest, res.size() - from);
+            break;
+        }
+        auto same = equal_range(res.begin(), res.end(), out.pivots[i]);
+        size_t to = (out.equal[i] ? same.first : same.second) - res.begin();
+        largest = max(largest, to - from);
+        from = same.second - res.begin();
+    }
+    out.imbalance = static_cast<double>(largest) * parts / res.size();
+    return out;
+}
+
+PivotSample samplePivots(const string& filename, size_t memBytes, int parts,
+                         const SortOptions& opts) {
+    return pivotsFrom(PositionalReader(filename), [&]() { return MappedFile(filename, opts); },
+                      memBytes, parts, opts);
+}
+
+PivotSample samplePivots(const ScratchSpace& scratch, const ScratchRun& run, size_t memBytes,
+                         int parts, const SortOptions& opts) {
+    return pivotsFrom(PositionalReader(scratch, run),
+                      [&]() { return MappedFile(scratch, run, opts); }, memBytes, parts, opts);
+}
+
+vector<int64_t> choosePivots(const string& filename, size_t memBytes, int parts,
+                             const SortOptions& opts) {
+    return samplePivots(filename, memBytes, parts, opts).pivots;
+}
+
+// Branchless classifier over the splitters laid out as an implicit binary
+// tree in breadth-first (Eytzinger) order, padded to 2^levels - 1 keys with
+// INT64_MAX. bucketOf(v) equals lower_bound(pivots, v) - pivots.begin().
+class SplitterTree {
+public:
+    explicit SplitterTree(const vector<int64_t>& pivots) {
+        while ((size_t(1) << levels_) - 1 < pivots.size()) ++levels_;
+        tree_.assign(size_t(1) << levels_, numeric_limits<int64_t>::max());
+        vector<int64_t> sorted(pivots);
+        sorted.resize(tree_.size() - 1, numeric_limits<int64_t>::max());
+        size_t next = 0;
+        fill(1, sorted, next);
+    }
+
+    // Classifies UNROLL values at once: the level loop is outside so that the
+    // independent descents overlap in the pipeline instead of waiting on each other
+    static constexpr size_t UNROLL = 8;
+    void classify(const int64_t* v, uint32_t* bucket) const {
+        uint32_t idx[UNROLL];
+        for (size_t j = 0; j < UNROLL; ++j) idx[j] = 1;
+        for (int l = 0; l < levels_; ++l)
+            for (size_t j = 0; j < UNROLL; ++j)
+                idx[j] = 2 * idx[j] + (tree_[idx[j]] < v[j]);
+        for (size_t j = 0; j < UNROLL; ++j) bucket[j] = idx[j] - (uint32_t(1) << levels_);
+    }
+
+    uint32_t bucketOf(int64_t v) const {
+        uint32_t idx = 1;
+        for (int l = 0; l < levels_; ++l)
+            idx = 2 * idx + (tree_[idx] < v);
+        return idx - (uint32_t(1) << levels_);
+    }
+
+private:
+    // In-order walk of the implicit tree assigns the sorted keys
+    void fill(size_t node, const vector<int64_t>& sorted, size_t& next) {
+        if (node >= tree_.size()) return;
+        fill(2 * node, sorted, next);
+        tree_[node] = sorted[next++];
+        fill(2 * node + 1, sorted, next);
+    }
+
+    int levels_ = 0;
+    vector<int64_t> tree_;   // tree_[0] unused, root at 1
+};
+
+// Partitions the mapped input into parts+1 scratch runs based on pivots.
+// Values outside [opts.minKey, opts.maxKey] are dropped, and partitions
+// that lie wholly outside get no output stream (their runs stay empty).
+// Values equal to a pivot marked in 'equal' only count in equalCounts.
+// The partitions are striped over the scratch files other than 'from', the
+// one the input is read from (any file when it is not a scratch run).
+static vector<uint64_t> partitionMapped(const MappedFile& in, const vector<int64_t>& pivots,
+                                        const vector<bool>& equal, vector<uint64_t>& equalCounts,
+                                        vector<ScratchRun>& outRuns, ScratchSpace& scratch,
+                                        size_t memBytes, const SortOptions& opts,
+                                        uint32_t from = UINT32_MAX) {
+    PhaseScope phase("partitioning");
     int p = pivots.size() + 1;
-    outFiles.clear();
+    int64_t lo = opts.minKey, hi = opts.maxKey;
+    bool ranged = lo != numeric_limits<int64_t>::min() || hi != numeric_limits<int64_t>::max();
+    // Partition i holds (pivots[i - 1], pivots[i]], or (pivots[i - 1],
+    // pivots[i]) with an equality bucket; the last one never has a bucket
+    vector<bool> live(p);
+    vector<uint8_t> bucketed(p, 0);
+    for (size_t i = 0; i < equal.size() && i < pivots.size(); ++i) bucketed[i] = equal[i];
+    equalCounts.assign(p - 1, 0);
+    for (int i = 0; i < p; ++i)
+        live[i] = (i + 1 == p || pivots[i] >= lo) && (i == 0 || pivots[i - 1] < hi);
+    size_t streams = count(live.begin(), live.end(), true);
+    // The input is memory-mapped; one output stream per live partition shares the memory
+    size_t depth = max<size_t>(1, opts.ioDepth);
+    size_t bufBytes = streamBuffer(memBytes, streams, depth, false, opts);
+    outRuns.assign(p, ScratchRun());
+    vector<RunWriter> outs;
+    outs.reserve(streams);
+    vector<RunWriter*> outOf(p, nullptr);
     for (int i = 0; i < p; ++i) {
-        string name = file + "_part" + to_string(i);
-        ofstream(name, ios::binary).close();
-        outFiles.push_back(name);
-    }
-
-    size_t bufInts = max<size_t>(1, memBytes / sizeof(int64_t));
-    vector<int64_t> buf(bufInts);
-    ifstream in(file, ios::binary);
-    while (in) {
-        in.read(reinterpret_cast<char*>(buf.data()), buf.size() * sizeof(int64_t));
-        size_t got = in.gcount() / sizeof(int64_t);
-        buf.resize(got);
-        for (auto v : buf) {
-            int idx = lower_bound(pivots.begin(), pivots.end(), v) - pivots.begin();
-            appendInts(outFiles[idx], {v});
+        outRuns[i] = scratch.newRunApart(from);
+        if (!live[i]) continue;
+        outs.emplace_back(scratch, outRuns[i], bufBytes, depth);
+        outOf[i] = &outs.back();
+    }
+
+    // Each stream's buffer is a whole number of blocks, so every bucket
+    // reaches the disk one block at a time
+    SplitterTree tree(pivots);
+    vector<uint64_t> counts(p, 0);
+    const int64_t* v = in.data();
+    size_t n = in.size(), i = 0;
+    uint32_t bucket[SplitterTree::UNROLL];
+    for (; i + SplitterTree::UNROLL <= n; i += SplitterTree::UNROLL) {
+        tree.classify(v + i, bucket);
+        for (size_t j = 0; j < SplitterTree::UNROLL; ++j) {
+            int64_t x = v[i + j];
+            if (ranged && (x < lo || x > hi)) continue;
+            uint32_t b = bucket[j];
+            if (bucketed[b] && x == pivots[b]) {
+                ++equalCounts[b];
+                continue;
+            }
+            outOf[b]->push(x);
+            ++counts[b];
         }
     }
+    for (; i < n; ++i) {
+        if (ranged && (v[i] < lo || v[i] > hi)) continue;
+        uint32_t b = tree.bucketOf(v[i]);
+        if (bucketed[b] && v[i] == pivots[b]) {
+            ++equalCounts[b];
+            continue;
+        }
+        outOf[b]->push(v[i]);
+        ++counts[b];
+    }
+    for (auto& out : outs) out.close();
+    return counts;
+}
+
+vector<uint64_t> partitionFile(const string& file, const vector<int64_t>& pivots,
+                               vector<ScratchRun>& outRuns, ScratchSpace& scratch,
+                               size_t memBytes, const SortOptions& opts) {
+    vector<uint64_t> equalCounts;
+    return partitionMapped(MappedFile(file, opts), pivots, {}, equalCounts, outRuns, scratch,
+                           memBytes, opts);
+}
+
+vector<uint64_t> partitionFile(const string& file, const PivotSample& split,
+                               vector<ScratchRun>& outRuns, vector<uint64_t>& equalCounts,
+                               ScratchSpace& scratch, size_t memBytes, const SortOptions& opts) {
+    return partitionMapped(MappedFile(file, opts), split.pivots, split.equal, equalCounts,
+                           outRuns, scratch, memBytes, opts);
+}
+
+// The input of a quicksort step: the original file, or a partition
+static MappedFile mapInput(const string& inFile, const ScratchRun* inRun,
+                           const ScratchSpace& scratch, const SortOptions& opts) {
+    return inRun ? MappedFile(scratch, *inRun, opts) : MappedFile(inFile, opts);
+}
+
+// 'n' copies of 'value' into outFile from value index 'first': an equality
+// bucket is already sorted, so it is written without being stored or read
+static void writeCopies(const string& outFile, uint64_t first, int64_t value, uint64_t n,
+                        const SortOptions& opts, MemoryBudget* budget) {
+    MemoryBudget::Lease lease(budget, outputStream(opts));
+    RunWriter out = RunWriter::at(outFile, opts.blockBytes, first);
+    for (uint64_t left = n; left > 0; --left)
+        out.push(value);
+    out.close();
+}
+
+// Sorts 'inFile' (or the partition 'inRun' when not null) into
+// outFile[first, first + size) of an already allocated output. Returns the
+// values written, at most 'limit' (0 = no limit).
+static uint64_t quicksortInto(const string& inFile, const ScratchRun* inRun, ScratchSpace& scratch,
+                              const string& outFile, uint64_t first, uint64_t limit,
+                              size_t memBytes, int parts, const SortOptions& opts,
+                              WorkStealingPool* pool, MemoryBudget* budget) {
+    size_t bytes = inRun ? inRun->bytes : getFileSize<int64_t>(inFile);
+    // A leaf holds its values and the stream writing them out
+    size_t leafBytes = chargedBytes(bytes) + outputStream(opts);
+    if (leafBytes <= memBytes) {
+        PhaseScope phase("leaf sort");
+        MemoryBudget::Lease lease(budget, leafBytes);
+        IoBuffer buf;
+        {
+            MappedFile in = mapInput(inFile, inRun, scratch, opts);
+            buf.assign(in.begin(), in.end());
+        }
+        // A partition's extents are reused as soon as it has been read
+        if (inRun) scratch.release(*inRun);
+        size_t n = buf.size();
+        if (selective(opts)) n = keepInRange(buf.data(), n, opts.minKey, opts.maxKey);
+        sortBuffer(buf.data(), n, opts.inMemorySort);
+        n = trimSorted(buf.data(), n, limit, opts.distinct);
+        // Written in its final place, so no sorted partition is copied again
+        RunWriter out = RunWriter::at(outFile, opts.blockBytes, first);
+        out.write(buf.data(), n);
+        out.close();
+        return n;
+    }
+
+    vector<ScratchRun> partRuns;
+    vector<uint64_t> counts, equalCounts;
+    PivotSample split;
+    {
+        // Concurrent partition passes split M between the workers; each
+        // pass needs the streams of two partitions at least, and gets no
+        // more partitions than its share holds the streams of
+        size_t stream = streamBytes(opts.blockBytes, opts.ioDepth, false, opts);
+        size_t work = pool ? max(memBytes / pool->size(), 2 * stream) : memBytes;
+        int fit = static_cast<int>(min<size_t>(parts, max<size_t>(2, work / stream)));
+        MemoryBudget::Lease lease(budget, work);
+        split = inRun ? samplePivots(scratch, *inRun, work, fit, opts)
+                      : samplePivots(inFile, work, fit, opts);
+        counts = partitionMapped(mapInput(inFile, inRun, scratch, opts), split.pivots,
+                                 split.equal, equalCounts, partRuns, scratch, work, opts,
+                                 inRun ? inRun->file : UINT32_MAX);
+    }
+    if (inRun) scratch.release(*inRun);
+    // Partition i starts right after the values of all smaller partitions
+    uint64_t written = 0;
+    for (size_t i = 0; i < partRuns.size(); ++i) {
+        // Partitions past the limit are dropped unread
+        if (limit > 0 && written >= limit) {
+            scratch.release(partRuns[i]);
+            continue;
+        }
+        uint64_t want = limit > 0 ? limit - written : 0;
+        uint64_t at = first + written;
+        if (pool) {
+            // A task workers steal from each other; it leases its working
+            // memory from the shared budget
+            pool->spawn([=, &inFile, &scratch, &outFile, &opts, run = partRuns[i]]() {
+                quicksortInto(inFile, &run, scratch, outFile, at, want, memBytes, parts, opts,
+                              pool, budget);
+            });
+            written += want > 0 ? min(counts[i], want) : counts[i];
+        } else {
+            written += quicksortInto(inFile, &partRuns[i], scratch, outFile, at, want, memBytes,
+                                     parts, opts, nullptr, nullptr);
+        }
+        // The equality bucket of pivots[i] follows partition i. A heavy value
+        // is written directly: one read and no recursion
+        if (i < equalCounts.size() && equalCounts[i] > 0 && (limit == 0 || written < limit)) {
+            uint64_t n = opts.distinct ? 1 : equalCounts[i];
+            if (limit > 0) n = min(n, limit - written);
+            writeCopies(outFile, first + written, split.pivots[i], n, opts, budget);
+            written += n;
+        }
+    }
+    return written;
 }
 
 // External quicksort main function
 void externalQuicksort(const string& inFile, const string& outFile,
-                       size_t memBytes, int parts) {
-    if (getFileSize<int64_t>(inFile) <= memBytes) { // Fixed template arg
-        sortInMemory(inFile, outFile);
+                       size_t memBytes, int parts, const SortOptions& opts) {
+    setIoBlockBytes(opts.blockBytes);
+    size_t bytes = getFileSize<int64_t>(inFile);
+    if (bytes <= memBytes) { // Fixed template arg
+        PhaseScope phase("in-memory sort");
+        sortInMemory(inFile, outFile, opts);
         return;
     }
-
-    auto pivots = choosePivots(inFile, memBytes, parts);
-    vector<string> partsF;
-    partitionFile(inFile, pivots, partsF, memBytes);
-
-    ofstream(outFile, ios::binary).close();
-    for (auto& f : partsF) {
-        string sorted = f + "_sorted";
-        externalQuicksort(f, sorted, memBytes, parts);
-        auto data = readInts(sorted, 0, getFileSize<int64_t>(sorted) / sizeof(int64_t)); // Fixed
-        appendInts(outFile, data);
-        remove(f.c_str());
-        remove(sorted.c_str());
+    // Every buffer from here on is carved out of M
+    MemoryArena arena(sortBudget(memBytes, opts));
+    ArenaScope charged(&arena);
+    memBytes = arena.limit();
+    // A selection only shrinks the output: it is cut to size at the end
+    uint64_t room = opts.limit > 0 ? min<uint64_t>(bytes, opts.limit * sizeof(int64_t)) : bytes;
+    preallocateFile(outFile, room);
+    ScratchSpace scratch = ScratchSpace::forSort(inFile, memBytes, opts);
+    uint64_t written = 0;
+    // With distinct values partition sizes are only known once written, so
+    // partitions can't be placed ahead of time by parallel tasks
+    if (opts.threads <= 1 || opts.distinct) {
+        written = quicksortInto(inFile, nullptr, scratch, outFile, 0, opts.limit, memBytes, parts,
+                                opts, nullptr, nullptr);
+    } else {
+        WorkStealingPool pool(opts.threads);
+        MemoryBudget budget(memBytes);
+        pool.spawn([&]() {
+            written = quicksortInto(inFile, nullptr, scratch, outFile, 0, opts.limit, memBytes,
+                                    parts, opts, &pool, &budget);
+        });
+        pool.wait();
     }
-}
\ No newline at end of file
+    if (written * sizeof(int64_t) != room) truncateFile(outFile, written * sizeof(int64_t));
+}
@@ -5,28 +5,52 @@
 #include <cstddef>
 #include <vector>
 #include <string>
-
-// Returns file size in bytes
-size_t getFileSize(const std::string& filename);
-
-// Reads up to 'count' int64_t values starting from 'start' index
-std::vector<int64_t> readInts(const std::string& filename, size_t start, size_t count);
-
-// Appends values to a binary file
-void appendInts(const std::string& filename, const std::vector<int64_t>& data);
-
-// Sorts small files in memory
-void sortInMemory(const std::string& inFile, const std::string& outFile);
-
-// Chooses pivots using reservoir sampling
-std::vector<int64_t> choosePivots(const std::string& filename, size_t memBytes, int parts);
-
-// Partitions file into 'parts+1' temporary files based on pivots
-void partitionFile(const std::string& file, const std::vector<int64_t>& pivots,
-                   std::vector<std::string>& outFiles, size_t memBytes);
+#include "disk_io.hpp"
+#include "scratch.hpp"
+#include "sort_options.hpp"
+
+// Splitters drawn from a sample of the input
+struct PivotSample {
+    std::vector<int64_t> pivots;    // Ascending and distinct
+    // equal[i]: pivots[i] is a heavy value (repeated among the quantiles or
+    // filling a partition's share of the sample) with an equality bucket
+    std::vector<bool> equal;
+    size_t sampleSize = 0;
+    // Largest partition left to sort over the ideal one (1 = perfect),
+    // measured on the sample; equality buckets are not counted, so large
+    // values flag a too-small sample
+    double imbalance = 1.0;
+};
+
+// Samples opts.sampleBlocks random blocks through positional reads (or the
+// whole input with skip-based reservoir sampling when it is 0) and picks
+// 'parts - 1' splitters. The same seed gives the same splitters.
+PivotSample samplePivots(const std::string& filename, size_t memBytes, int parts,
+                         const SortOptions& opts = {});
+PivotSample samplePivots(const ScratchSpace& scratch, const ScratchRun& run, size_t memBytes,
+                         int parts, const SortOptions& opts = {});
+
+// Chooses pivots using samplePivots
+std::vector<int64_t> choosePivots(const std::string& filename, size_t memBytes, int parts,
+                                  const SortOptions& opts = {});
+
+// Partitions file into 'pivots.size() + 1' runs of 'scratch' based on
+// pivots, returns the number of values written to each
+std::vector<uint64_t> partitionFile(const std::string& file, const std::vector<int64_t>& pivots,
+                                    std::vector<ScratchRun>& outRuns, ScratchSpace& scratch,
+                                    size_t memBytes, const SortOptions& opts = {});
+
+// Same, with the equality buckets of split.equal: values equal to such a
+// pivot are only counted, in equalCounts[i], and partition i then holds
+// (pivots[i - 1], pivots[i]). Copies of one value need no sorting, so a
+// heavy value never lands in a partition that cannot shrink.
+std::vector<uint64_t> partitionFile(const std::string& file, const PivotSample& split,
+                                    std::vector<ScratchRun>& outRuns,
+                                    std::vector<uint64_t>& equalCounts, ScratchSpace& scratch,
+                                    size_t memBytes, const SortOptions& opts = {});
 
 // External quicksort main function
 void externalQuicksort(const std::string& inFile, const std::string& outFile,
-                       size_t memBytes, int parts);
+                       size_t memBytes, int parts, const SortOptions& opts = {});
 
 #endif // EXTERNAL_QUICKSORT_HPP
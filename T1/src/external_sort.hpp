@@ -0,0 +1,262 @@
+#ifndef EXTERNAL_SORT_HPP
+#define EXTERNAL_SORT_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "disk_io.hpp"
+#include "external_mergesort.hpp"
+#include "io_stats.hpp"
+#include "loser_tree.hpp"
+#include "scratch.hpp"
+#include "sort_options.hpp"
+
+// Key extractor for records that are their own sort key
+struct IdentityKey {
+    template<typename T>
+    const T& operator()(const T& record) const { return record; }
+};
+
+// Orders whole records by comparing their extracted keys
+template<typename Record, typename KeyExtractor, typename Compare>
+struct RecordLess {
+    KeyExtractor key;
+    Compare cmp;
+
+    bool operator()(const Record& a, const Record& b) const {
+        return cmp(key(a), key(b));
+    }
+};
+
+// Buffered sequential reader of fixed-size records from a file or a scratch
+// run. A file that ends inside a record is rejected up front.
+template<typename Record>
+class RecordReader {
+public:
+    RecordReader(const std::string& filename, size_t bufferBytes)
+        : fd_(openForRead(filename)),
+          buf_(std::max<size_t>(1, bufferBytes / sizeof(Record))) {
+        size_t bytes = getFileSize<int64_t>(filename);
+        if (bytes % sizeof(Record) != 0) {
+            closeFile(fd_);
+            throw std::runtime_error(filename + ": " + std::to_string(bytes) +
+                                     " bytes is not a whole number of " +
+                                     std::to_string(sizeof(Record)) + "-byte records");
+        }
+    }
+    RecordReader(const ScratchSpace& scratch, const ScratchRun& run, size_t bufferBytes)
+        : fd_(-1), scratch_(&scratch), run_(&run),
+          buf_(std::max<size_t>(1, bufferBytes / sizeof(Record))) {}
+    ~RecordReader() { closeFile(fd_); }
+    RecordReader(RecordReader&& other) noexcept
+        : fd_(other.fd_), scratch_(other.scratch_), run_(other.run_), buf_(std::move(other.buf_)),
+          pos_(other.pos_), len_(other.len_), offset_(other.offset_) {
+        other.fd_ = -1;
+    }
+    RecordReader(const RecordReader&) = delete;
+    RecordReader& operator=(const RecordReader&) = delete;
+    RecordReader& operator=(RecordReader&&) = delete;
+
+    bool next(Record& record) {
+        if (pos_ == len_ && !refill()) return false;
+        record = buf_[pos_++];
+        return true;
+    }
+
+    // Reads up to 'count' records into dst, returns how many were read
+    size_t read(Record* dst, size_t count) {
+        size_t got = 0;
+        while (got < count && (pos_ < len_ || refill())) {
+            size_t n = std::min(count - got, len_ - pos_);
+            std::copy(buf_.data() + pos_, buf_.data() + pos_ + n, dst + got);
+            pos_ += n;
+            got += n;
+        }
+        return got;
+    }
+
+private:
+    bool refill() {
+        size_t want = buf_.size() * sizeof(Record);
+        size_t bytes = scratch_ ? scratch_->read(*run_, offset_, buf_.data(), want)
+                                : readFullyAt(fd_, buf_.data(), want, offset_);
+        len_ = bytes / sizeof(Record);
+        offset_ += len_ * sizeof(Record);
+        pos_ = 0;
+        return len_ > 0;
+    }
+
+    int fd_;
+    const ScratchSpace* scratch_ = nullptr;
+    const ScratchRun* run_ = nullptr;
+    std::vector<Record, PageAlignedAllocator<Record>> buf_;
+    size_t pos_ = 0, len_ = 0;
+    uint64_t offset_ = 0;
+};
+
+// Buffered sequential writer of fixed-size records to a file or a scratch run
+template<typename Record>
+class RecordWriter {
+public:
+    RecordWriter(const std::string& filename, size_t bufferBytes)
+        : fd_(openForWrite(filename)) {
+        buf_.reserve(std::max<size_t>(1, bufferBytes / sizeof(Record)));
+    }
+    RecordWriter(ScratchSpace& scratch, ScratchRun& run, size_t bufferBytes)
+        : fd_(-1), scratch_(&scratch), run_(&run) {
+        buf_.reserve(std::max<size_t>(1, bufferBytes / sizeof(Record)));
+    }
+    ~RecordWriter() { close(); }
+    RecordWriter(const RecordWriter&) = delete;
+    RecordWriter& operator=(const RecordWriter&) = delete;
+
+    void push(const Record& record) {
+        buf_.push_back(record);
+        if (buf_.size() == buf_.capacity()) flush();
+    }
+
+    // Writes 'count' records straight to the file, bypassing the buffer
+    void write(const Record* src, size_t count) {
+        flush();
+        put(src, count * sizeof(Record));
+    }
+
+    void flush() {
+        if (buf_.empty()) return;
+        put(buf_.data(), buf_.size() * sizeof(Record));
+        buf_.clear();
+    }
+
+    void close() {
+        if (fd_ < 0 && !run_) return;
+        flush();
+        closeFile(fd_);
+        fd_ = -1;
+        run_ = nullptr;
+    }
+
+private:
+    void put(const void* src, size_t bytes) {
+        if (run_) {
+            scratch_->append(*run_, src, bytes);
+        } else {
+            writeFullyAt(fd_, src, bytes, offset_);
+            offset_ += bytes;
+        }
+    }
+
+    int fd_;
+    ScratchSpace* scratch_ = nullptr;
+    ScratchRun* run_ = nullptr;
+    std::vector<Record, PageAlignedAllocator<Record>> buf_;
+    uint64_t offset_ = 0;
+};
+
+namespace external_sort_detail {
+
+// True when the request is exactly the ascending int64_t sort, which the
+// specialized kernels (SIMD, radix, loser tree over raw values) already serve
+template<typename Record, typename KeyExtractor, typename Compare>
+constexpr bool isPlainInt64 =
+    std::is_same_v<Record, int64_t> && std::is_same_v<KeyExtractor, IdentityKey> &&
+    (std::is_same_v<Compare, std::less<>> || std::is_same_v<Compare, std::less<int64_t>>);
+
+// Sorted runs of what memBytes holds besides the input and run streams, in
+// 'scratch'; an input that fits in a single run is written straight to
+// 'outFile' instead, and no run is returned
+template<typename Record, typename Less>
+std::vector<ScratchRun> createRecordRuns(const std::string& inFile, const std::string& outFile,
+                                         ScratchSpace& scratch, size_t memBytes,
+                                         const SortOptions& opts, Less less) {
+    PhaseScope phase("run formation");
+    size_t streams = 2 * streamBytes(opts.blockBytes, 1, false, opts);
+    size_t room = memBytes > streams ? (memBytes - streams) / 64 * 64 : 0;
+    size_t cap = std::max<size_t>(1, room / sizeof(Record));
+    std::vector<Record, PageAlignedAllocator<Record>> buf(cap);
+    RecordReader<Record> in(inFile, opts.blockBytes);
+    std::vector<ScratchRun> runs;
+    while (true) {
+        size_t got = in.read(buf.data(), cap);
+        if (got == 0 && !runs.empty()) break;
+        std::sort(buf.begin(), buf.begin() + got, less);
+        if (runs.empty() && got < cap) {
+            RecordWriter<Record>(outFile, opts.blockBytes).write(buf.data(), got);
+            break;
+        }
+        runs.push_back(scratch.newRun());
+        RecordWriter<Record> out(scratch, runs.back(), opts.blockBytes);
+        out.write(buf.data(), got);
+    }
+    return runs;
+}
+
+// Multi-pass k-way merge of record runs; the last pass writes 'outFile'
+template<typename Record, typename Less>
+void mergeRecordRuns(std::vector<ScratchRun>& runs, const std::string& outFile,
+                     ScratchSpace& scratch, size_t memBytes, int arity,
+                     const SortOptions& opts, Less less) {
+    // No wider than memBytes holds the one-block streams of
+    size_t k = std::max(2, arity);
+    while (k > 2 && (k + 1) * streamBytes(opts.blockBytes, 1, false, opts) > memBytes) --k;
+    for (int pass = 0; !runs.empty(); ++pass) {
+        PhaseScope phase("merge pass " + std::to_string(pass));
+        bool lastPass = runs.size() <= k;
+        std::vector<ScratchRun> next;
+        next.reserve((runs.size() + k - 1) / k);
+        for (size_t i = 0; i < runs.size(); i += k) {
+            size_t end = std::min(i + k, runs.size());
+            size_t bufBytes = streamBuffer(memBytes, end - i + 1, 1, false, opts);
+            {
+                std::vector<RecordReader<Record>> ins;
+                ins.reserve(end - i);
+                for (size_t j = i; j < end; ++j)
+                    ins.emplace_back(scratch, runs[j], bufBytes);
+                if (!lastPass) next.push_back(scratch.newRun());
+                RecordWriter<Record> out = lastPass ? RecordWriter<Record>(outFile, bufBytes)
+                                                    : RecordWriter<Record>(scratch, next.back(), bufBytes);
+                LoserTree<RecordReader<Record>, Record, Less> tree(ins, less);
+                Record r;
+                while (tree.next(r))
+                    out.push(r);
+            }
+            // Merged runs give their extents to the next outputs
+            for (size_t j = i; j < end; ++j)
+                scratch.release(runs[j]);
+        }
+        runs.swap(next);
+    }
+}
+
+} // namespace external_sort_detail
+
+// External mergesort of a file of fixed-size 'Record's ordered by
+// cmp(key(a), key(b)). Records are moved whole, payload included. The plain
+// ascending int64_t instantiation compiles down to externalMergesort.
+template<typename Record, typename KeyExtractor = IdentityKey, typename Compare = std::less<>>
+void externalSort(const std::string& inFile, const std::string& outFile,
+                  size_t memBytes, int arity, const SortOptions& opts = {},
+                  KeyExtractor key = {}, Compare cmp = {}) {
+    static_assert(std::is_trivially_copyable_v<Record>,
+                  "externalSort moves records as raw bytes");
+    using namespace external_sort_detail;
+    if constexpr (isPlainInt64<Record, KeyExtractor, Compare>) {
+        externalMergesort(inFile, outFile, memBytes, arity, opts);
+    } else {
+        setIoBlockBytes(opts.blockBytes);
+        // Every buffer is carved out of M
+        MemoryArena arena(sortBudget(memBytes, opts));
+        ArenaScope charged(&arena);
+        memBytes = arena.limit();
+        RecordLess<Record, KeyExtractor, Compare> less{key, cmp};
+        ScratchSpace scratch = ScratchSpace::forSort(inFile, memBytes, opts);
+        auto runs = createRecordRuns<Record>(inFile, outFile, scratch, memBytes, opts, less);
+        if (runs.empty()) return;
+        mergeRecordRuns<Record>(runs, outFile, scratch, memBytes, arity, opts, less);
+    }
+}
+
+#endif // EXTERNAL_SORT_HPP
@@ -0,0 +1,314 @@
+#include "in_memory_sort.hpp"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define T1_HAVE_X86 1
+#define T1_AVX2 __attribute__((target("avx2,popcnt")))
+#endif
+
+#ifdef T1_HAVE_X86
+namespace {
+
+// Below this size a partition is finished with the 16-wide sorting network
+constexpr size_t NETWORK_SIZE = 16;
+
+T1_AVX2 inline __m256i min64(__m256i a, __m256i b) {
+    return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+}
+
+T1_AVX2 inline __m256i max64(__m256i a, __m256i b) {
+    return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+}
+
+T1_AVX2 inline void minmax(__m256i& a, __m256i& b) {
+    __m256i gt = _mm256_cmpgt_epi64(a, b);
+    __m256i lo = _mm256_blendv_epi8(a, b, gt);
+    b = _mm256_blendv_epi8(b, a, gt);
+    a = lo;
+}
+
+T1_AVX2 inline __m256i reverse4(__m256i v) {
+    return _mm256_permute4x64_epi64(v, 0x1B);
+}
+
+// Sorts a bitonic 4-lane vector: compare lanes 2 apart, then 1 apart
+T1_AVX2 inline __m256i bitonic4(__m256i v) {
+    __m256i p = _mm256_permute4x64_epi64(v, 0x4E);
+    v = _mm256_blend_epi32(min64(v, p), max64(v, p), 0xF0);
+    p = _mm256_permute4x64_epi64(v, 0xB1);
+    return _mm256_blend_epi32(min64(v, p), max64(v, p), 0xCC);
+}
+
+// Merges two sorted 4-lane vectors into the sorted 8 values (a, b)
+T1_AVX2 inline void merge8(__m256i& a, __m256i& b) {
+    b = reverse4(b);
+    minmax(a, b);
+    a = bitonic4(a);
+    b = bitonic4(b);
+}
+
+// Sorts a bitonic sequence of 8 values held in (a, b)
+T1_AVX2 inline void bitonic8(__m256i& a, __m256i& b) {
+    minmax(a, b);
+    a = bitonic4(a);
+    b = bitonic4(b);
+}
+
+// Sorting network for 16 values in four registers: sort the columns,
+// transpose, then two rounds of bitonic merges.
+T1_AVX2 void sort16(__m256i& r0, __m256i& r1, __m256i& r2, __m256i& r3) {
+    minmax(r0, r1); minmax(r2, r3);
+    minmax(r0, r2); minmax(r1, r3);
+    minmax(r1, r2);
+
+    __m256i t0 = _mm256_unpacklo_epi64(r0, r1), t1 = _mm256_unpackhi_epi64(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi64(r2, r3), t3 = _mm256_unpackhi_epi64(r2, r3);
+    r0 = _mm256_permute2x128_si256(t0, t2, 0x20);
+    r1 = _mm256_permute2x128_si256(t1, t3, 0x20);
+    r2 = _mm256_permute2x128_si256(t0, t2, 0x31);
+    r3 = _mm256_permute2x128_si256(t1, t3, 0x31);
+
+    merge8(r0, r1);
+    merge8(r2, r3);
+    // (r0, r1) and (r2, r3) are sorted runs of 8: reverse the second and split
+    __m256i b0 = reverse4(r3), b1 = reverse4(r2);
+    minmax(r0, b0);
+    minmax(r1, b1);
+    bitonic8(r0, r1);
+    bitonic8(b0, b1);
+    r2 = b0;
+    r3 = b1;
+}
+
+T1_AVX2 void sortSmall(int64_t* data, size_t n) {
+    alignas(32) int64_t tmp[NETWORK_SIZE];
+    std::fill(tmp + n, tmp + NETWORK_SIZE, INT64_MAX);
+    std::copy(data, data + n, tmp);
+    __m256i r0 = _mm256_load_si256(reinterpret_cast<__m256i*>(tmp));
+    __m256i r1 = _mm256_load_si256(reinterpret_cast<__m256i*>(tmp + 4));
+    __m256i r2 = _mm256_load_si256(reinterpret_cast<__m256i*>(tmp + 8));
+    __m256i r3 = _mm256_load_si256(reinterpret_cast<__m256i*>(tmp + 12));
+    sort16(r0, r1, r2, r3);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(tmp), r0);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(tmp + 4), r1);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(tmp + 8), r2);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(tmp + 12), r3);
+    std::copy(tmp, tmp + n, data);
+}
+
+// For each 4-bit "greater than pivot" mask, the 32-bit lane permutation that
+// moves the <= lanes to the front and the > lanes to the back.
+struct CompressTable {
+    alignas(32) int32_t perm[16][8];
+    CompressTable() {
+        for (int mask = 0; mask < 16; ++mask) {
+            int out = 0;
+            for (int pass = 0; pass < 2; ++pass)
+                for (int lane = 0; lane < 4; ++lane)
+                    if (((mask >> lane) & 1) == pass) {
+                        perm[mask][2 * out] = 2 * lane;
+                        perm[mask][2 * out + 1] = 2 * lane + 1;
+                        ++out;
+                    }
+        }
+    }
+};
+
+const CompressTable compressTable;
+
+// Partitions one vector around 'pivot' into the free slots at lw and rw
+T1_AVX2 inline void partitionVec(__m256i v, __m256i pivot, int64_t* data,
+                                 size_t& lw, size_t& rw) {
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, pivot)));
+    __m256i idx = _mm256_load_si256(reinterpret_cast<const __m256i*>(compressTable.perm[mask]));
+    __m256i packed = _mm256_permutevar8x32_epi32(v, idx);
+    int greater = _mm_popcnt_u32(mask);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + lw), packed);
+    lw += 4 - greater;
+    rw -= greater;
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + rw - (4 - greater)), packed);
+}
+
+// In-place vectorized partition of data[0..n), n >= 8: values <= pivot end up
+// in [0, result), values > pivot in [result, n). The first and last vectors
+// are held in registers so that every store lands on already-read slots.
+T1_AVX2 size_t partitionAvx2(int64_t* data, size_t n, int64_t pivotValue) {
+    __m256i pivot = _mm256_set1_epi64x(pivotValue);
+    __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+    __m256i last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + n - 4));
+    size_t l = 4, r = n - 4;      // Unread values are data[l..r)
+    size_t lw = 0, rw = n;        // Next free slot on the left, end of the right part
+    while (r - l >= 4) {
+        __m256i v;
+        if (l - lw <= rw - r) {
+            v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + l));
+            l += 4;
+        } else {
+            r -= 4;
+            v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + r));
+        }
+        partitionVec(v, pivot, data, lw, rw);
+    }
+    int64_t rest[4];
+    size_t restN = r - l;
+    std::copy(data + l, data + r, rest);
+    for (size_t i = 0; i < restN; ++i) {
+        if (rest[i] <= pivotValue) data[lw++] = rest[i];
+        else data[--rw] = rest[i];
+    }
+    partitionVec(first, pivot, data, lw, rw);
+    partitionVec(last, pivot, data, lw, rw);
+    return lw;
+}
+
+int64_t medianOf3(int64_t a, int64_t b, int64_t c) {
+    return std::max(std::min(a, b), std::min(std::max(a, b), c));
+}
+
+T1_AVX2 void quicksortAvx2(int64_t* data, size_t n, int depth) {
+    while (n > NETWORK_SIZE) {
+        if (depth-- == 0) {
+            std::sort(data, data + n);
+            return;
+        }
+        int64_t pivot = medianOf3(medianOf3(data[0], data[1], data[2]),
+                                  medianOf3(data[n / 2 - 1], data[n / 2], data[n / 2 + 1]),
+                                  medianOf3(data[n - 3], data[n - 2], data[n - 1]));
+        size_t mid = partitionAvx2(data, n, pivot);
+        if (mid == n) {
+            // Nothing above the pivot: split off its copies, which are already placed
+            if (pivot == INT64_MIN) return;
+            n = partitionAvx2(data, n, pivot - 1);
+            continue;
+        }
+        // Recurse into the smaller side, loop on the larger one
+        if (mid < n - mid) {
+            quicksortAvx2(data, mid, depth);
+            data += mid;
+            n -= mid;
+        } else {
+            quicksortAvx2(data + mid, n - mid, depth);
+            n = mid;
+        }
+    }
+    if (n > 1) sortSmall(data, n);
+}
+
+} // namespace
+#endif
+
+bool simdSortAvailable() {
+#ifdef T1_HAVE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+namespace {
+
+// Auto switches to radix sorting from this many values on
+constexpr size_t RADIX_THRESHOLD = size_t(1) << 20;
+
+// Buckets smaller than this are finished by the comparison kernel
+constexpr size_t RADIX_LEAF = 256;
+
+void comparisonSort(int64_t* data, size_t n, bool simd) {
+#ifdef T1_HAVE_X86
+    if (simd && simdSortAvailable()) {
+        int depth = 2 * static_cast<int>(std::log2(static_cast<double>(n) + 1)) + 4;
+        quicksortAvx2(data, n, depth);
+        return;
+    }
+#endif
+    (void)simd;
+    std::sort(data, data + n);
+}
+
+// Byte of x at 'shift' with the sign bit flipped, so that the unsigned
+// digit order matches signed order
+inline unsigned digit(int64_t x, int shift) {
+    return static_cast<unsigned>(((static_cast<uint64_t>(x) ^ (uint64_t(1) << 63)) >> shift) & 0xFF);
+}
+
+// In-place MSD radix sort (American flag sort) on the byte at 'shift' and below
+void americanFlagSort(int64_t* data, size_t n, int shift) {
+    while (n >= RADIX_LEAF) {
+        size_t count[256] = {0};
+        for (size_t i = 0; i < n; ++i) ++count[digit(data[i], shift)];
+        size_t head[256], tail[256], offset = 0;
+        for (int b = 0; b < 256; ++b) {
+            head[b] = offset;
+            offset += count[b];
+            tail[b] = offset;
+        }
+        if (count[digit(data[0], shift)] == n) {
+            // All keys share this byte: skip to the next one without moving anything
+            if (shift == 0) return;
+            shift -= 8;
+            continue;
+        }
+        // Cycle-leader permutation: drop each value into its bucket's next free slot
+        for (int b = 0; b < 256; ++b) {
+            while (head[b] < tail[b]) {
+                int64_t v = data[head[b]];
+                unsigned d = digit(v, shift);
+                while (d != static_cast<unsigned>(b)) {
+                    std::swap(v, data[head[d]++]);
+                    d = digit(v, shift);
+                }
+                data[head[b]++] = v;
+            }
+        }
+        if (shift == 0) return;
+        size_t start = 0;
+        for (int b = 0; b < 256; ++b) {
+            if (count[b] > 1) americanFlagSort(data + start, count[b], shift - 8);
+            start += count[b];
+        }
+        return;
+    }
+    comparisonSort(data, n, true);
+}
+
+} // namespace
+
+bool selective(const SortOptions& opts) {
+    return opts.limit > 0 || opts.distinct || opts.minKey != INT64_MIN || opts.maxKey != INT64_MAX;
+}
+
+size_t keepInRange(int64_t* data, size_t n, int64_t lo, int64_t hi) {
+    // Branchless: every value is written, the cursor only moves past kept ones
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        int64_t v = data[i];
+        data[k] = v;
+        k += (v >= lo) & (v <= hi);
+    }
+    return k;
+}
+
+size_t trimSorted(int64_t* data, size_t n, uint64_t limit, bool distinct) {
+    if (distinct) n = std::unique(data, data + n) - data;
+    return limit > 0 ? std::min<uint64_t>(n, limit) : n;
+}
+
+void sortBuffer(int64_t* data, size_t n, InMemorySort strategy) {
+    if (strategy == InMemorySort::Auto)
+        strategy = n >= RADIX_THRESHOLD ? InMemorySort::Radix : InMemorySort::Simd;
+    switch (strategy) {
+    case InMemorySort::Radix:
+        americanFlagSort(data, n, 56);
+        break;
+    case InMemorySort::Simd:
+        comparisonSort(data, n, true);
+        break;
+    default:
+        comparisonSort(data, n, false);
+        break;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef IN_MEMORY_SORT_HPP
+#define IN_MEMORY_SORT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include "sort_options.hpp"
+
+// Sorts data[0..n) ascending with the requested kernel. Simd falls back to
+// std::sort when the CPU lacks AVX2; Radix needs no extra memory; Auto uses
+// radix sorting for large buffers and the comparison kernels for small ones.
+void sortBuffer(int64_t* data, size_t n, InMemorySort strategy = InMemorySort::Auto);
+
+// True if this CPU can run the vectorized kernel
+bool simdSortAvailable();
+
+// True when opts asks for a top-K, a key range or distinct values
+bool selective(const SortOptions& opts);
+
+// Compacts data[0..n) to the values in [lo, hi], keeping their order;
+// returns how many are left
+size_t keepInRange(int64_t* data, size_t n, int64_t lo, int64_t hi);
+
+// On sorted data[0..n): drops repeated values if 'distinct', then keeps at
+// most 'limit' values (0 = no limit); returns how many are left
+size_t trimSorted(int64_t* data, size_t n, uint64_t limit, bool distinct);
+
+#endif // IN_MEMORY_SORT_HPP
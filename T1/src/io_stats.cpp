@@ -0,0 +1,267 @@
+#include "io_stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <unistd.h>
+#include "sort_options.hpp"
+
+namespace {
+
+constexpr size_t MAX_PHASES = 256;
+constexpr size_t MAX_SPANS = 1 << 16;
+
+struct AtomicCounters {
+    std::atomic<uint64_t> bytes{0}, blocks{0}, calls{0};
+    std::atomic<uint64_t> latency[LATENCY_BUCKETS] = {};
+
+    void add(uint64_t offset, size_t n, double seconds, uint64_t blockBytes) {
+        bytes.fetch_add(n, std::memory_order_relaxed);
+        calls.fetch_add(1, std::memory_order_relaxed);
+        if (n > 0)
+            blocks.fetch_add((offset + n - 1) / blockBytes - offset / blockBytes + 1,
+                             std::memory_order_relaxed);
+        uint64_t us = static_cast<uint64_t>(seconds * 1e6);
+        size_t b = us == 0 ? 0 : std::min<size_t>(LATENCY_BUCKETS - 1, 63 - __builtin_clzll(us));
+        latency[b].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void copyTo(IoCounters& out) const {
+        out.bytes = bytes.load();
+        out.blocks = blocks.load();
+        out.calls = calls.load();
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i) out.latency[i] = latency[i].load();
+    }
+
+    void clear() {
+        bytes = blocks = calls = 0;
+        for (auto& l : latency) l = 0;
+    }
+};
+
+struct PhaseStats {
+    AtomicCounters read, write;
+    std::atomic<uint64_t> nanos{0}, peakMemory{0}, peakBudget{0};
+};
+
+struct Span {
+    int phase;
+    size_t thread;
+    double start, seconds;
+};
+
+// Fixed-size tables, so recording never races with a reallocation
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::string> names{"other"};
+    PhaseStats phases[MAX_PHASES];
+    std::vector<Span> spans;
+    std::atomic<uint64_t> blockBytes{DEFAULT_BLOCK_SIZE};
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+thread_local int threadPhase = 0;
+
+// Small per-thread number for the trace rows
+std::atomic<size_t> threadCount{0};
+thread_local size_t threadIndex = threadCount++;
+
+double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - registry().epoch).count();
+}
+
+int phaseId(const std::string& name) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto it = std::find(r.names.begin(), r.names.end(), name);
+    if (it != r.names.end()) return static_cast<int>(it - r.names.begin());
+    if (r.names.size() == MAX_PHASES) return 0;   // Table full: count as "other"
+    r.names.push_back(name);
+    return static_cast<int>(r.names.size() - 1);
+}
+
+// Resident set right now (ru_maxrss would be the process-lifetime peak)
+uint64_t residentBytes() {
+    unsigned long long sizePages = 0, residentPages = 0;
+    FILE* f = std::fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (std::fscanf(f, "%llu %llu", &sizePages, &residentPages) != 2) residentPages = 0;
+    std::fclose(f);
+    return residentPages * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+}
+
+void notePeak(std::atomic<uint64_t>& peak, uint64_t bytes) {
+    uint64_t seen = peak.load(std::memory_order_relaxed);
+    while (bytes > seen && !peak.compare_exchange_weak(seen, bytes)) {}
+}
+
+std::string escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+void countersJson(std::ostream& out, const IoCounters& c) {
+    out << "{\"bytes\": " << c.bytes << ", \"blocks\": " << c.blocks
+        << ", \"calls\": " << c.calls << ", \"latency_us_log2\": [";
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) out << (i ? ", " : "") << c.latency[i];
+    out << "]}";
+}
+
+void addCounters(IoCounters& into, const IoCounters& c) {
+    into.bytes += c.bytes;
+    into.blocks += c.blocks;
+    into.calls += c.calls;
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) into.latency[i] += c.latency[i];
+}
+
+} // namespace
+
+PhaseScope::PhaseScope(const std::string& name)
+    : previous_(threadPhase), named_(true), start_(now()) {
+    threadPhase = phaseId(name);
+    notePeak(registry().phases[threadPhase].peakMemory, residentBytes());
+}
+
+PhaseScope::PhaseScope(int id) : previous_(threadPhase), named_(false), start_(0) {
+    threadPhase = id;
+}
+
+PhaseScope::~PhaseScope() {
+    if (named_) {
+        Registry& r = registry();
+        double seconds = now() - start_;
+        PhaseStats& p = r.phases[threadPhase];
+        p.nanos.fetch_add(static_cast<uint64_t>(seconds * 1e9), std::memory_order_relaxed);
+        notePeak(p.peakMemory, residentBytes());
+        std::lock_guard<std::mutex> lock(r.mutex);
+        if (r.spans.size() < MAX_SPANS)
+            r.spans.push_back({threadPhase, threadIndex, start_, seconds});
+    }
+    threadPhase = previous_;
+}
+
+int currentPhase() {
+    return threadPhase;
+}
+
+void setIoBlockBytes(size_t blockBytes) {
+    registry().blockBytes = std::max<size_t>(1, blockBytes);
+}
+
+void recordRead(uint64_t offset, size_t bytes, double seconds) {
+    Registry& r = registry();
+    r.phases[threadPhase].read.add(offset, bytes, seconds, r.blockBytes.load(std::memory_order_relaxed));
+}
+
+void recordWrite(uint64_t offset, size_t bytes, double seconds) {
+    Registry& r = registry();
+    r.phases[threadPhase].write.add(offset, bytes, seconds, r.blockBytes.load(std::memory_order_relaxed));
+}
+
+void recordBudgetUse(uint64_t bytes) {
+    notePeak(registry().phases[threadPhase].peakBudget, bytes);
+}
+
+std::vector<PhaseReport> ioReport() {
+    Registry& r = registry();
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        names = r.names;
+    }
+    std::vector<PhaseReport> out;
+    for (size_t i = 0; i < names.size(); ++i) {
+        const PhaseStats& p = r.phases[i];
+        PhaseReport rep;
+        rep.name = names[i];
+        p.read.copyTo(rep.read);
+        p.write.copyTo(rep.write);
+        rep.seconds = p.nanos.load() / 1e9;
+        rep.peakMemoryBytes = p.peakMemory.load();
+        rep.peakBudgetBytes = p.peakBudget.load();
+        if (rep.read.calls || rep.write.calls || rep.seconds > 0 || rep.peakBudgetBytes > 0)
+            out.push_back(rep);
+    }
+    return out;
+}
+
+PhaseReport ioTotals() {
+    PhaseReport total;
+    total.name = "total";
+    for (auto& p : ioReport()) {
+        addCounters(total.read, p.read);
+        addCounters(total.write, p.write);
+        total.peakMemoryBytes = std::max(total.peakMemoryBytes, p.peakMemoryBytes);
+        total.peakBudgetBytes = std::max(total.peakBudgetBytes, p.peakBudgetBytes);
+    }
+    return total;
+}
+
+void resetIoStats() {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (auto& p : r.phases) {
+        p.read.clear();
+        p.write.clear();
+        p.nanos = 0;
+        p.peakMemory = 0;
+        p.peakBudget = 0;
+    }
+    r.spans.clear();
+}
+
+std::string ioStatsJson() {
+    std::ostringstream out;
+    out << "{\"block_bytes\": " << registry().blockBytes.load() << ", \"phases\": [";
+    auto phases = ioReport();
+    for (size_t i = 0; i < phases.size(); ++i) {
+        const PhaseReport& p = phases[i];
+        out << (i ? ", " : "") << "{\"name\": \"" << escape(p.name) << "\", \"seconds\": "
+            << p.seconds << ", \"peak_memory_bytes\": " << p.peakMemoryBytes
+            << ", \"peak_budget_bytes\": " << p.peakBudgetBytes << ", \"read\": ";
+        countersJson(out, p.read);
+        out << ", \"write\": ";
+        countersJson(out, p.write);
+        out << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+void writeIoStatsJson(const std::string& filename) {
+    std::ofstream(filename) << ioStatsJson() << "\n";
+}
+
+void writeChromeTrace(const std::string& filename) {
+    Registry& r = registry();
+    std::vector<Span> spans;
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(r.mutex);
+        spans = r.spans;
+        names = r.names;
+    }
+    // Complete ("X") events with microsecond timestamps, one row per thread
+    std::ofstream out(filename);
+    out << "{\"traceEvents\": [";
+    for (size_t i = 0; i < spans.size(); ++i) {
+        const Span& s = spans[i];
+        out << (i ? ",\n" : "\n") << "{\"name\": \"" << escape(names[s.phase])
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << s.thread
+            << ", \"ts\": " << static_cast<uint64_t>(s.start * 1e6)
+            << ", \"dur\": " << static_cast<uint64_t>(s.seconds * 1e6) << "}";
+    }
+    out << "\n]}\n";
+}
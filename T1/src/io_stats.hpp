@@ -0,0 +1,78 @@
+#ifndef IO_STATS_HPP
+#define IO_STATS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// I/O accounting shared by every sort. The disk_io layer records each read
+// and write syscall (bytes, B-sized blocks touched, latency) against the
+// phase of the calling thread; thread pools carry the phase of the thread
+// that queued a task over to the worker that runs it.
+
+// Latency histogram buckets: bucket i counts calls that took [2^i, 2^(i+1)) us
+constexpr size_t LATENCY_BUCKETS = 24;
+
+struct IoCounters {
+    uint64_t bytes = 0;
+    uint64_t blocks = 0;     // Distinct B-sized blocks touched, summed per call
+    uint64_t calls = 0;      // Syscalls (pread/pwrite/mmap)
+    uint64_t latency[LATENCY_BUCKETS] = {};
+};
+
+struct PhaseReport {
+    std::string name;
+    IoCounters read, write;
+    double seconds = 0;          // Wall time summed over the scopes of this phase
+    uint64_t peakMemoryBytes = 0; // Largest resident set at a scope's entry or exit
+    uint64_t peakBudgetBytes = 0; // Most of the sort's memory budget in use at once
+};
+
+// Marks the calling thread as working on phase 'name' until destroyed
+// (phases nest; the previous one is restored). Named scopes are also
+// recorded as spans for the Chrome trace.
+class PhaseScope {
+public:
+    explicit PhaseScope(const std::string& name);
+    // Re-enters phase 'id' (from currentPhase()) on another thread, without a span
+    explicit PhaseScope(int id);
+    ~PhaseScope();
+    PhaseScope(const PhaseScope&) = delete;
+    PhaseScope& operator=(const PhaseScope&) = delete;
+
+private:
+    int previous_;
+    bool named_;
+    double start_;
+};
+
+// Phase of the calling thread (0 = "other")
+int currentPhase();
+
+// Block size B used to count blocks (defaults to DEFAULT_BLOCK_SIZE)
+void setIoBlockBytes(size_t blockBytes);
+
+void recordRead(uint64_t offset, size_t bytes, double seconds);
+void recordWrite(uint64_t offset, size_t bytes, double seconds);
+// Bytes of the memory budget in use, reported by the arena after each allocation
+void recordBudgetUse(uint64_t bytes);
+
+// Counters of every phase with any activity, in order of first use
+std::vector<PhaseReport> ioReport();
+
+// Totals over all phases
+PhaseReport ioTotals();
+
+// Clears counters and spans (phase names are kept)
+void resetIoStats();
+
+// Report as a JSON document
+std::string ioStatsJson();
+
+// Writes the report as JSON, or the phase spans in Chrome's trace event
+// format (chrome://tracing, Perfetto)
+void writeIoStatsJson(const std::string& filename);
+void writeChromeTrace(const std::string& filename);
+
+#endif // IO_STATS_HPP
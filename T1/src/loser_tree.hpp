@@ -0,0 +1,97 @@
+#ifndef LOSER_TREE_HPP
+#define LOSER_TREE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Tournament tree of losers for k-way merging of sorted sources.
+// 'Source' must provide 'bool next(T&)'. Internal node p (1 <= p < k) keeps
+// the loser of the match played there, node 0 keeps the overall winner, and
+// leaf i sits at position k + i. Popping an element replays only the path
+// from the winner's leaf to the root: ceil(log2 k) comparisons per element.
+template<typename Source, typename T = int64_t, typename Less = std::less<T>>
+class LoserTree {
+public:
+    explicit LoserTree(std::vector<Source>& sources, Less less = Less())
+        : sources_(sources), less_(less), k_(sources.size()),
+          tree_(k_ > 0 ? k_ : 1, 0), keys_(k_), done_(k_, 1) {
+        for (size_t i = 0; i < k_; ++i)
+            done_[i] = !sources_[i].next(keys_[i]);
+        if (k_ > 1) build();
+    }
+
+    // Pops the smallest head among all sources, returns false once all are exhausted
+    bool next(T& out) {
+        if (k_ == 0) return false;
+        uint32_t w = tree_[0];
+        if (done_[w]) return false;
+        out = keys_[w];
+        done_[w] = !sources_[w].next(keys_[w]);
+        replay(w);
+        return true;
+    }
+
+    // Index of the source whose head is the current minimum
+    size_t top() const { return tree_[0]; }
+
+private:
+    // True if source a's head must be emitted before source b's
+    bool beats(uint32_t a, uint32_t b) const {
+        if (done_[a] | done_[b]) return done_[b];
+        return less_(keys_[a], keys_[b]);
+    }
+
+    void replay(uint32_t leaf) {
+        uint32_t winner = leaf;
+        for (size_t p = (leaf + k_) >> 1; p > 0; p >>= 1) {
+            uint32_t other = tree_[p];
+            if (beats(other, winner)) {
+                tree_[p] = winner;
+                winner = other;
+            }
+        }
+        tree_[0] = winner;
+    }
+
+    void build() {
+        std::vector<uint32_t> win(k_);
+        auto winnerAt = [&](size_t node) {
+            return node >= k_ ? static_cast<uint32_t>(node - k_) : win[node];
+        };
+        for (size_t p = k_ - 1; p > 0; --p) {
+            uint32_t a = winnerAt(2 * p), b = winnerAt(2 * p + 1);
+            if (beats(b, a)) std::swap(a, b);
+            win[p] = a;
+            tree_[p] = b;
+        }
+        tree_[0] = win[1];
+    }
+
+    std::vector<Source>& sources_;
+    Less less_;
+    size_t k_;
+    std::vector<uint32_t> tree_;
+    std::vector<T> keys_;
+    std::vector<uint8_t> done_;
+};
+
+// Loser tree source over an in-memory sorted range
+template<typename T = int64_t>
+struct BasicSpanSource {
+    const T* pos;
+    const T* end;
+
+    BasicSpanSource(const T* begin, const T* finish) : pos(begin), end(finish) {}
+
+    bool next(T& value) {
+        if (pos == end) return false;
+        value = *pos++;
+        return true;
+    }
+};
+
+using SpanSource = BasicSpanSource<>;
+
+#endif // LOSER_TREE_HPP
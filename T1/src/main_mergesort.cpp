@@ -1,19 +1,148 @@
 #include "external_mergesort.hpp"
+#include "autotune.hpp"
+#include "scratch.hpp"
+#include "disk_io.hpp"
+#include "io_stats.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <ctime>
+#include <ios>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+// Streaming mode: "-" as input or output means stdin or stdout, which
+// cannot be re-read or sought, so values are pushed into a StreamingSorter
+// as they arrive and the sorted stream is written as it is merged.
+static void sortStream(const std::string& inFile, const std::string& outFile,
+                       size_t memBytes, int arity, const SortOptions& opts) {
+    StreamingSorter sorter(memBytes, arity, opts);
+    std::vector<int64_t> chunk(std::max<size_t>(opts.blockBytes, 64 << 10) / sizeof(int64_t));
+    char* bytes = reinterpret_cast<char*>(chunk.data());
+    int in = inFile == "-" ? STDIN_FILENO : openForRead(inFile);
+    size_t have = 0;   // Pipes may deliver part of a value; it is kept for the next read
+    while (true) {
+        ssize_t got = ::read(in, bytes + have, chunk.size() * sizeof(int64_t) - have);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) throw std::ios_base::failure(std::string("Read failed: ") + std::strerror(errno));
+        if (got == 0) break;
+        have += got;
+        size_t values = have / sizeof(int64_t);
+        sorter.push(chunk.data(), values);
+        have -= values * sizeof(int64_t);
+        std::memmove(bytes, bytes + values * sizeof(int64_t), have);
+    }
+    if (in != STDIN_FILENO) closeFile(in);
+    if (have != 0)
+        throw std::ios_base::failure("Input ends " + std::to_string(have) +
+                                     " bytes into an int64_t value");
+
+    SortedStream sorted = sorter.finish();
+    int out = outFile == "-" ? STDOUT_FILENO : openForWrite(outFile);
+    while (size_t n = sorted.read(chunk.data(), chunk.size())) {
+        size_t done = 0;
+        while (done < n * sizeof(int64_t)) {
+            ssize_t put = ::write(out, bytes + done, n * sizeof(int64_t) - done);
+            if (put < 0 && errno == EINTR) continue;
+            if (put < 0) throw std::ios_base::failure(std::string("Write failed: ") + std::strerror(errno));
+            done += put;
+        }
+    }
+    if (out != STDOUT_FILENO) closeFile(out);
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
+    if (argc < 5) {
         std::cerr << "Usage: " << argv[0]
-                  << " input output memoryLimitBytes arity\n";
+                  << " input|- output|- memoryLimitBytes arity|auto"
+                  << " [--replacement-selection|--natural-runs] [--io-depth=N] [--threads=N]"
+                  << " [--sort-kernel=auto|std|simd|radix] [--pack-runs]"
+                  << " [--scratch-dir=DIR]... [--direct-io] [--map-populate] [--huge-pages]"
+                  << " [--limit=K] [--min-key=X] [--max-key=Y] [--distinct]"
+                  << " [--stats=FILE.json] [--trace=FILE.json] [--profile=FILE]\n";
         return 1;
     }
+    SortOptions opts;
+    std::string statsFile, traceFile, profileFile = "device_profile.txt";
+    for (int i = 5; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag == "--replacement-selection") {
+            opts.runFormation = RunFormation::ReplacementSelection;
+        } else if (flag == "--natural-runs") {
+            opts.runFormation = RunFormation::Natural;
+        } else if (flag == "--pack-runs") {
+            opts.packRuns = true;
+        } else if (flag.rfind("--io-depth=", 0) == 0) {
+            opts.ioDepth = std::stoul(flag.substr(11));
+        } else if (flag.rfind("--threads=", 0) == 0) {
+            opts.threads = std::stoul(flag.substr(10));
+        } else if (flag == "--sort-kernel=std") {
+            opts.inMemorySort = InMemorySort::Std;
+        } else if (flag == "--sort-kernel=simd") {
+            opts.inMemorySort = InMemorySort::Simd;
+        } else if (flag == "--sort-kernel=radix") {
+            opts.inMemorySort = InMemorySort::Radix;
+        } else if (flag == "--sort-kernel=auto") {
+            opts.inMemorySort = InMemorySort::Auto;
+        } else if (flag.rfind("--scratch-dir=", 0) == 0) {
+            opts.scratchDirs.push_back(flag.substr(14));
+        } else if (flag == "--direct-io") {
+            opts.directIo = true;
+        } else if (flag == "--map-populate") {
+            opts.mapPopulate = true;
+        } else if (flag == "--huge-pages") {
+            opts.mapHugePages = true;
+        } else if (flag.rfind("--limit=", 0) == 0) {
+            opts.limit = std::stoull(flag.substr(8));
+        } else if (flag.rfind("--min-key=", 0) == 0) {
+            opts.minKey = std::stoll(flag.substr(10));
+        } else if (flag.rfind("--max-key=", 0) == 0) {
+            opts.maxKey = std::stoll(flag.substr(10));
+        } else if (flag == "--distinct") {
+            opts.distinct = true;
+        } else if (flag.rfind("--profile=", 0) == 0) {
+            profileFile = flag.substr(10);
+        } else if (flag.rfind("--stats=", 0) == 0) {
+            statsFile = flag.substr(8);
+        } else if (flag.rfind("--trace=", 0) == 0) {
+            traceFile = flag.substr(8);
+        } else {
+            std::cerr << "Unknown option: " << flag << "\n";
+            return 1;
+        }
+    }
     std::srand(std::time(nullptr));
-    externalMergesort(
-        argv[1],                    // input file
-        argv[2],                    // output file
-        std::stoll(argv[3]),        // memory limit in bytes
-        std::stoi(argv[4])          // merger arity
-    );
+    size_t memBytes = std::stoll(argv[3]);
+    std::string inFile = argv[1], outFile = argv[2];
+    bool streaming = inFile == "-" || outFile == "-";
+    int arity;
+    if (std::string(argv[4]) == "auto") {
+        DeviceProfile profile = loadOrMeasureProfile(profileFile, ScratchSpace::dirsFor(inFile, opts)[0],
+                                                     opts.blockBytes);
+        // The size of stdin is unknown: plan as if it held 64 memory loads
+        uint64_t n = inFile == "-" ? 64 * (memBytes / sizeof(int64_t))
+                                   : getFileSize<int64_t>(inFile) / sizeof(int64_t);
+        SortPlan plan = planSort(profile, n, memBytes, opts.blockBytes);
+        arity = plan.arity;
+        std::cerr << "auto arity " << arity << " (" << plan.mergePasses << " merge passes, "
+                  << plan.mergesortSeconds << " s predicted)\n";
+    } else {
+        arity = std::stoi(argv[4]);
+    }
+    if (streaming) {
+        sortStream(inFile, outFile, memBytes, arity, opts);
+    } else {
+        externalMergesort(
+            argv[1],                    // input file
+            argv[2],                    // output file
+            memBytes,                   // memory limit in bytes
+            arity,                      // merger arity
+            opts
+        );
+    }
+    if (!statsFile.empty()) writeIoStatsJson(statsFile);
+    if (!traceFile.empty()) writeChromeTrace(traceFile);
     return 0;
 }
@@ -1,19 +1,89 @@
 #include "external_quicksort.hpp"
+#include "autotune.hpp"
+#include "io_stats.hpp"
+#include "scratch.hpp"
 #include <iostream>
-#include <ctime>
+#include <string>
 
 int main(int argc, char* argv[]) {
-    if (argc != 5) {
+    if (argc < 5) {
         std::cerr << "Usage: " << argv[0]
-                  << " input output memoryLimitBytes partitions\n";
+                  << " input output memoryLimitBytes partitions|auto"
+                  << " [--io-depth=N] [--threads=N] [--sort-kernel=auto|std|simd|radix]"
+                  << " [--sample-blocks=N] [--seed=N]"
+                  << " [--scratch-dir=DIR]... [--direct-io] [--map-populate] [--huge-pages]"
+                  << " [--limit=K] [--min-key=X] [--max-key=Y] [--distinct]"
+                  << " [--stats=FILE.json] [--trace=FILE.json] [--profile=FILE]\n";
         return 1;
     }
-    std::srand(std::time(nullptr));
+    SortOptions opts;
+    std::string statsFile, traceFile, profileFile = "device_profile.txt";
+    for (int i = 5; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (flag.rfind("--io-depth=", 0) == 0) {
+            opts.ioDepth = std::stoul(flag.substr(11));
+        } else if (flag.rfind("--threads=", 0) == 0) {
+            opts.threads = std::stoul(flag.substr(10));
+        } else if (flag.rfind("--sample-blocks=", 0) == 0) {
+            opts.sampleBlocks = std::stoul(flag.substr(16));
+        } else if (flag.rfind("--seed=", 0) == 0) {
+            opts.seed = std::stoull(flag.substr(7));
+        } else if (flag == "--sort-kernel=std") {
+            opts.inMemorySort = InMemorySort::Std;
+        } else if (flag == "--sort-kernel=simd") {
+            opts.inMemorySort = InMemorySort::Simd;
+        } else if (flag == "--sort-kernel=radix") {
+            opts.inMemorySort = InMemorySort::Radix;
+        } else if (flag == "--sort-kernel=auto") {
+            opts.inMemorySort = InMemorySort::Auto;
+        } else if (flag.rfind("--scratch-dir=", 0) == 0) {
+            opts.scratchDirs.push_back(flag.substr(14));
+        } else if (flag == "--direct-io") {
+            opts.directIo = true;
+        } else if (flag == "--map-populate") {
+            opts.mapPopulate = true;
+        } else if (flag == "--huge-pages") {
+            opts.mapHugePages = true;
+        } else if (flag.rfind("--limit=", 0) == 0) {
+            opts.limit = std::stoull(flag.substr(8));
+        } else if (flag.rfind("--min-key=", 0) == 0) {
+            opts.minKey = std::stoll(flag.substr(10));
+        } else if (flag.rfind("--max-key=", 0) == 0) {
+            opts.maxKey = std::stoll(flag.substr(10));
+        } else if (flag == "--distinct") {
+            opts.distinct = true;
+        } else if (flag.rfind("--profile=", 0) == 0) {
+            profileFile = flag.substr(10);
+        } else if (flag.rfind("--stats=", 0) == 0) {
+            statsFile = flag.substr(8);
+        } else if (flag.rfind("--trace=", 0) == 0) {
+            traceFile = flag.substr(8);
+        } else {
+            std::cerr << "Unknown option: " << flag << "\n";
+            return 1;
+        }
+    }
+    size_t memBytes = std::stoll(argv[3]);
+    int parts;
+    if (std::string(argv[4]) == "auto") {
+        DeviceProfile profile = loadOrMeasureProfile(profileFile, ScratchSpace::dirsFor(argv[1], opts)[0],
+                                                     opts.blockBytes);
+        SortPlan plan = planSort(profile, getFileSize<int64_t>(argv[1]) / sizeof(int64_t),
+                                 memBytes, opts.blockBytes);
+        parts = plan.parts;
+        std::cerr << "auto partitions " << parts << " (" << plan.quicksortLevels << " levels, "
+                  << plan.quicksortSeconds << " s predicted)\n";
+    } else {
+        parts = std::stoi(argv[4]);
+    }
     externalQuicksort(
         argv[1],      // input file
         argv[2],      // output file
-        std::stoll(argv[3]), // memory limit in bytes
-        std::stoi(argv[4])   // number of partitions
+        memBytes,     // memory limit in bytes
+        parts,        // number of partitions
+        opts
     );
+    if (!statsFile.empty()) writeIoStatsJson(statsFile);
+    if (!traceFile.empty()) writeChromeTrace(traceFile);
     return 0;
-}
\ No newline at end of file
+}
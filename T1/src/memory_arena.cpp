@@ -0,0 +1,120 @@
+#include "memory_arena.hpp"
+#include <algorithm>
+#include <sys/mman.h>
+#include "io_stats.hpp"
+
+namespace {
+
+constexpr size_t PAGE = 4096;
+constexpr size_t LINE = 64;
+// Freed blocks at least this large give their pages back to the kernel
+constexpr size_t RETURN_BYTES = size_t(1) << 20;
+
+thread_local MemoryArena* threadArena = nullptr;
+
+size_t roundUp(size_t x, size_t to) {
+    return (x + to - 1) / to * to;
+}
+
+} // namespace
+
+MemoryArena::MemoryArena(size_t limit)
+    : limit_(limit), mapBytes_(roundUp(std::max<size_t>(limit, 1), PAGE)) {
+    void* p = ::mmap(nullptr, mapBytes_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        throw MemoryBudgetExceeded("Failed to reserve a memory arena of " +
+                                   std::to_string(mapBytes_) + " bytes");
+    base_ = static_cast<char*>(p);
+    free_[0] = mapBytes_;
+}
+
+MemoryArena::~MemoryArena() {
+    for (auto& s : spilled_) ::operator delete(s.first, std::align_val_t(PAGE));
+    ::munmap(base_, mapBytes_);
+}
+
+void* MemoryArena::allocate(size_t bytes) {
+    size_t size = roundUp(std::max<size_t>(bytes, 1), LINE);
+    size_t align = size >= PAGE ? PAGE : LINE;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (inUse_ + size > limit_)
+        throw MemoryBudgetExceeded("Memory budget exceeded: " + std::to_string(size) +
+                                   " more bytes with " + std::to_string(inUse_) + " of " +
+                                   std::to_string(limit_) + " in use");
+    void* p = nullptr;
+    // First fit; the alignment gap in front of the block stays a hole
+    for (auto it = free_.begin(); it != free_.end(); ++it) {
+        size_t start = roundUp(it->first, align);
+        size_t end = it->first + it->second;
+        if (start + size > end) continue;
+        size_t holeStart = it->first;
+        free_.erase(it);
+        if (start > holeStart) free_[holeStart] = start - holeStart;
+        if (end > start + size) free_[start + size] = end - (start + size);
+        p = base_ + start;
+        break;
+    }
+    // Fragmentation alone never fails a sort that fits the budget: the block
+    // comes from the heap, still charged
+    if (!p) {
+        p = ::operator new(size, std::align_val_t(PAGE));
+        spilled_[p] = size;
+    }
+    inUse_ += size;
+    peak_ = std::max(peak_, inUse_);
+    recordBudgetUse(inUse_);
+    return p;
+}
+
+void MemoryArena::deallocate(void* p, size_t bytes) {
+    size_t size = roundUp(std::max<size_t>(bytes, 1), LINE);
+    char* c = static_cast<char*>(p);
+    std::lock_guard<std::mutex> lock(mutex_);
+    inUse_ -= size;
+    if (c < base_ || c >= base_ + mapBytes_) {
+        spilled_.erase(p);
+        ::operator delete(p, std::align_val_t(PAGE));
+        return;
+    }
+    if (size >= RETURN_BYTES) {
+        size_t from = roundUp(c - base_, PAGE), to = (c - base_ + size) / PAGE * PAGE;
+        if (to > from) ::madvise(base_ + from, to - from, MADV_DONTNEED);
+    }
+    size_t offset = c - base_;
+    auto next = free_.lower_bound(offset);
+    if (next != free_.end() && offset + size == next->first) {
+        size += next->second;
+        next = free_.erase(next);
+    }
+    if (next != free_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            prev->second += size;
+            return;
+        }
+    }
+    free_[offset] = size;
+}
+
+size_t MemoryArena::inUse() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return inUse_;
+}
+
+size_t MemoryArena::peak() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
+
+MemoryArena* currentArena() {
+    return threadArena;
+}
+
+ArenaScope::ArenaScope(MemoryArena* arena) : previous_(threadArena) {
+    threadArena = arena;
+}
+
+ArenaScope::~ArenaScope() {
+    threadArena = previous_;
+}
@@ -0,0 +1,70 @@
+#ifndef MEMORY_ARENA_HPP
+#define MEMORY_ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+
+// Thrown when an allocation would take a sort past its memory budget
+class MemoryBudgetExceeded : public std::bad_alloc {
+public:
+    explicit MemoryBudgetExceeded(std::string message) : message_(std::move(message)) {}
+    const char* what() const noexcept override { return message_.c_str(); }
+
+private:
+    std::string message_;
+};
+
+// The memory of one sort: a single mapping of 'limit' bytes, reserved up
+// front, out of which the I/O and sort buffers of every phase are carved.
+// Each allocation is charged against the limit, and one that does not fit
+// throws MemoryBudgetExceeded instead of growing the process. Pages are
+// only touched when used and large freed blocks go back to the kernel, so
+// the resident size follows the bytes in use. Thread-safe.
+class MemoryArena {
+public:
+    explicit MemoryArena(size_t limit);
+    ~MemoryArena();
+    MemoryArena(const MemoryArena&) = delete;
+    MemoryArena& operator=(const MemoryArena&) = delete;
+
+    // Blocks of 4 KiB or more are page-aligned (for O_DIRECT), smaller ones
+    // cache-line aligned
+    void* allocate(size_t bytes);
+    void deallocate(void* p, size_t bytes);
+
+    size_t limit() const { return limit_; }
+    size_t inUse() const;
+    size_t peak() const;
+
+private:
+    char* base_ = nullptr;
+    size_t limit_, mapBytes_;
+    mutable std::mutex mutex_;
+    std::map<size_t, size_t> free_;             // Offset -> bytes of each hole, coalesced
+    std::unordered_map<void*, size_t> spilled_; // Heap blocks served when no hole was large enough
+    size_t inUse_ = 0, peak_ = 0;
+};
+
+// Arena that the buffers allocated by the calling thread are charged to
+// (null: plain heap)
+MemoryArena* currentArena();
+
+// Makes 'arena' current for the calling thread until destroyed (scopes
+// nest); thread pools carry it over to the tasks they run
+class ArenaScope {
+public:
+    explicit ArenaScope(MemoryArena* arena);
+    ~ArenaScope();
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    MemoryArena* previous_;
+};
+
+#endif // MEMORY_ARENA_HPP
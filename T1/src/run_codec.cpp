@@ -0,0 +1,98 @@
+#include "run_codec.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+constexpr uint32_t MAX_PACKED_BITS = 56;
+
+size_t roundUp8(size_t bytes) {
+    return (bytes + 7) & ~size_t(7);
+}
+
+// Packed deltas are read as unaligned 64-bit words, so a block keeps up to
+// 7 bytes of slack after its last delta
+size_t payloadBytes(uint32_t count, uint32_t bits) {
+    size_t deltas = count > 0 ? count - 1 : 0;
+    if (bits == 0 || deltas == 0) return 0;
+    if (bits == 64) return deltas * sizeof(uint64_t);
+    return roundUp8((deltas * bits + 7) / 8 + 7);
+}
+
+size_t packBlock(const int64_t* src, uint32_t n, unsigned char* dst) {
+    uint64_t widest = 0;
+    for (uint32_t i = 1; i < n; ++i)
+        widest |= static_cast<uint64_t>(src[i]) - static_cast<uint64_t>(src[i - 1]);
+    uint32_t bits = widest == 0 ? 0 : 64 - __builtin_clzll(widest);
+    if (bits > MAX_PACKED_BITS) bits = 64;
+
+    PackedHeader h{src[0], n, bits};
+    std::memcpy(dst, &h, sizeof(h));
+    unsigned char* out = dst + sizeof(h);
+    size_t payload = payloadBytes(n, bits);
+    std::memset(out, 0, payload);
+    for (uint32_t i = 1; i < n && bits > 0; ++i) {
+        uint64_t d = static_cast<uint64_t>(src[i]) - static_cast<uint64_t>(src[i - 1]);
+        if (bits == 64) {
+            std::memcpy(out + (i - 1) * sizeof(d), &d, sizeof(d));
+            continue;
+        }
+        // (bit & 7) + bits <= 63: each delta fits in one unaligned word
+        uint64_t bit = uint64_t(i - 1) * bits, word;
+        std::memcpy(&word, out + (bit >> 3), sizeof(word));
+        word |= d << (bit & 7);
+        std::memcpy(out + (bit >> 3), &word, sizeof(word));
+    }
+    return sizeof(h) + payload;
+}
+
+} // namespace
+
+size_t packedBlockBytes(const PackedHeader& header) {
+    return sizeof(PackedHeader) + payloadBytes(header.count, header.bits);
+}
+
+size_t packedBound(size_t n) {
+    size_t blocks = (n + PACKED_BLOCK_VALUES - 1) / PACKED_BLOCK_VALUES;
+    // Per block: the header, one word of unaligned-load slack and rounding
+    return blocks * (sizeof(PackedHeader) + 2 * sizeof(uint64_t)) + n * sizeof(uint64_t);
+}
+
+size_t packValues(const int64_t* src, size_t n, void* dst) {
+    unsigned char* out = static_cast<unsigned char*>(dst);
+    size_t bytes = 0;
+    for (size_t i = 0; i < n; i += PACKED_BLOCK_VALUES) {
+        uint32_t count = static_cast<uint32_t>(std::min(PACKED_BLOCK_VALUES, n - i));
+        bytes += packBlock(src + i, count, out + bytes);
+    }
+    return bytes;
+}
+
+void unpackBlock(const void* src, int64_t* dst) {
+    PackedHeader h;
+    std::memcpy(&h, src, sizeof(h));
+    if (h.count == 0) return;
+    const unsigned char* in = static_cast<const unsigned char*>(src) + sizeof(h);
+    uint64_t* deltas = reinterpret_cast<uint64_t*>(dst) + 1;
+    uint32_t n = h.count - 1;
+    // Branch-free unpacking with independent iterations (vectorizable), then
+    // a prefix sum rebuilds the values from the base
+    if (h.bits == 0) {
+        std::fill(deltas, deltas + n, 0);
+    } else if (h.bits == 64) {
+        std::memcpy(deltas, in, n * sizeof(uint64_t));
+    } else {
+        const uint64_t mask = (uint64_t(1) << h.bits) - 1;
+        for (uint32_t i = 0; i < n; ++i) {
+            uint64_t bit = uint64_t(i) * h.bits, word;
+            std::memcpy(&word, in + (bit >> 3), sizeof(word));
+            deltas[i] = (word >> (bit & 7)) & mask;
+        }
+    }
+    uint64_t x = static_cast<uint64_t>(h.base);
+    dst[0] = h.base;
+    for (uint32_t i = 0; i < n; ++i) {
+        x += deltas[i];
+        dst[i + 1] = static_cast<int64_t>(x);
+    }
+}
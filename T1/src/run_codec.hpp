@@ -0,0 +1,32 @@
+#ifndef RUN_CODEC_HPP
+#define RUN_CODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Packed run format: a sequence of blocks, each a PackedHeader followed by
+// the deltas between consecutive values bit-packed at a fixed width. Sorted
+// runs have small non-negative deltas; any input round-trips (deltas wrap).
+struct PackedHeader {
+    int64_t base;       // First value of the block, the minimum for sorted runs
+    uint32_t count;     // Values in the block, base included
+    uint32_t bits;      // Width of every packed delta: 0..56 or 64 (stored raw)
+};
+
+// Values per encoded block, so a reader decodes into a fixed-size buffer
+constexpr size_t PACKED_BLOCK_VALUES = 1024;
+
+// Bytes of a block with this header, header included (always a multiple of 8)
+size_t packedBlockBytes(const PackedHeader& header);
+
+// Upper bound on the encoded size of 'n' values
+size_t packedBound(size_t n);
+
+// Encodes src[0..n) as blocks of up to PACKED_BLOCK_VALUES into dst (which
+// must hold packedBound(n) bytes), returns the bytes written
+size_t packValues(const int64_t* src, size_t n, void* dst);
+
+// Decodes the block at 'src' into dst (room for header.count values)
+void unpackBlock(const void* src, int64_t* dst);
+
+#endif // RUN_CODEC_HPP
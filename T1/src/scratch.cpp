@@ -0,0 +1,239 @@
+#include "scratch.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <ios>
+#include <fcntl.h>
+#include <unistd.h>
+#include "disk_io.hpp"
+#include "thread_pool.hpp"
+
+namespace {
+
+// An unlinked file in 'dir': O_TMPFILE where supported, else mkstemp + unlink
+int openUnlinked(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR, 0600);
+    if (fd >= 0) return fd;
+    std::string path = dir + "/extsort-XXXXXX";
+    fd = ::mkstemp(&path[0]);
+    if (fd < 0)
+        throw std::ios_base::failure("Failed to create scratch file in: " + dir);
+    ::unlink(path.c_str());
+    return fd;
+}
+
+// Second, independent open of 'fd' with O_DIRECT; -1 if the file system refuses
+int reopenDirect(int fd) {
+    std::string self = "/proc/self/fd/" + std::to_string(fd);
+    return ::open(self.c_str(), O_RDWR | O_DIRECT);
+}
+
+void growFile(int fd, uint64_t from, uint64_t bytes) {
+    if (::posix_fallocate(fd, from, bytes) != 0 && ::ftruncate(fd, from + bytes) != 0)
+        throw std::ios_base::failure("Failed to grow scratch file");
+}
+
+uint64_t roundUp(uint64_t x, uint64_t to) {
+    return (x + to - 1) / to * to;
+}
+
+} // namespace
+
+ScratchSpace::ScratchSpace(const std::vector<std::string>& dirs, size_t extentBytes,
+                           uint64_t reserveBytes, bool direct)
+    : extentBytes_(roundUp(std::max<size_t>(extentBytes, 1), DIRECT_ALIGN)),
+      direct_(direct),
+      files_(dirs.empty() ? 1 : dirs.size()),
+      writable_(files_.size()) {
+    uint64_t perFile = roundUp((reserveBytes + files_.size() - 1) / files_.size(), extentBytes_);
+    try {
+        for (size_t i = 0; i < files_.size(); ++i) {
+            File& f = files_[i];
+            f.fd = openUnlinked(dirs.empty() ? "." : dirs[i]);
+            if (direct_) f.directFd = reopenDirect(f.fd);
+            direct_ = direct_ && f.directFd >= 0;
+            if (perFile > 0) growFile(f.fd, 0, perFile);
+            f.reserved = perFile;
+        }
+        if (files_.size() > 1)
+            for (size_t i = 0; i < files_.size(); ++i)
+                ioPools_.push_back(std::make_unique<ThreadPool>(IO_THREADS_PER_FILE));
+    } catch (...) {
+        for (auto& f : files_) {
+            if (f.directFd >= 0) ::close(f.directFd);
+            if (f.fd >= 0) ::close(f.fd);
+        }
+        throw;
+    }
+}
+
+ScratchSpace::~ScratchSpace() {
+    ioPools_.clear();
+    for (auto& f : files_) {
+        if (f.directFd >= 0) ::close(f.directFd);
+        if (f.fd >= 0) ::close(f.fd);
+    }
+}
+
+std::vector<std::string> ScratchSpace::dirsFor(const std::string& inFile, const SortOptions& opts) {
+    std::vector<std::string> dirs = opts.scratchDirs;
+    if (dirs.empty()) {
+        size_t slash = inFile.rfind('/');
+        dirs.push_back(slash == std::string::npos ? "." : inFile.substr(0, std::max<size_t>(slash, 1)));
+    }
+    return dirs;
+}
+
+ScratchSpace ScratchSpace::forSort(const std::string& inFile, size_t memBytes,
+                                   const SortOptions& opts) {
+    return ScratchSpace(dirsFor(inFile, opts), extentBytesFor(memBytes), getFileSize<int64_t>(inFile), opts.directIo);
+}
+
+size_t ScratchSpace::extentBytesFor(size_t memBytes) {
+    return std::min<size_t>(std::max<size_t>(memBytes / 16, 64 << 10), 4 << 20);
+}
+
+ScratchRun ScratchSpace::newRun() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ScratchRun run;
+    run.file = nextFile_;
+    nextFile_ = (nextFile_ + 1) % writable_;
+    return run;
+}
+
+ScratchRun ScratchSpace::newRunApart(uint32_t file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ScratchRun run;
+    run.file = nextFile_;
+    if (run.file == file && writable_ > 1) run.file = (run.file + 1) % writable_;
+    nextFile_ = (run.file + 1) % writable_;
+    return run;
+}
+
+ThreadPool& ScratchSpace::ioPool(uint32_t file) const {
+    return file < ioPools_.size() ? *ioPools_[file] : ioThreadPool();
+}
+
+uint32_t ScratchSpace::addSource(const std::string& filename) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    File f;
+    f.fd = openForRead(filename);
+    f.source = true;
+    files_.push_back(f);
+    return static_cast<uint32_t>(files_.size() - 1);
+}
+
+ScratchRun ScratchSpace::inPlace(uint32_t source, uint64_t offset, uint64_t bytes) const {
+    // Full-size extents, as locate() expects; the last one may reach past
+    // the range, which readers never ask for
+    ScratchRun run;
+    run.file = source;
+    for (uint64_t at = 0; at < bytes; at += extentBytes_)
+        run.extents.push_back({source, offset + at, extentBytes_});
+    run.bytes = bytes;
+    return run;
+}
+
+Extent ScratchSpace::allocate(uint32_t file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    File& f = files_[file];
+    Extent e{file, 0, extentBytes_};
+    if (!f.free.empty()) {
+        e.offset = f.free.back();
+        f.free.pop_back();
+    } else {
+        if (f.end + extentBytes_ > f.reserved) {
+            uint64_t grow = std::max<uint64_t>(extentBytes_, roundUp(f.reserved / 2, extentBytes_));
+            growFile(f.fd, f.reserved, grow);
+            f.reserved += grow;
+        }
+        e.offset = f.end;
+        f.end += extentBytes_;
+    }
+    inUse_ += extentBytes_;
+    peak_ = std::max(peak_, inUse_);
+    return e;
+}
+
+void ScratchSpace::reserve(ScratchRun& run, uint64_t bytes) {
+    while (run.extents.size() * extentBytes_ < bytes)
+        run.extents.push_back(allocate(run.file));
+}
+
+void ScratchSpace::release(const ScratchRun& run) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const Extent& e : run.extents) {
+        if (files_[e.file].source) continue;
+        files_[e.file].free.push_back(e.offset);
+        inUse_ -= e.bytes;
+    }
+}
+
+std::vector<Extent> ScratchSpace::locate(const ScratchRun& run, uint64_t offset,
+                                         uint64_t bytes) const {
+    std::vector<Extent> pieces;
+    while (bytes > 0) {
+        const Extent& e = run.extents.at(offset / extentBytes_);
+        uint64_t within = offset % extentBytes_;
+        uint64_t n = std::min(bytes, extentBytes_ - within);
+        pieces.push_back({e.file, e.offset + within, n});
+        offset += n;
+        bytes -= n;
+    }
+    return pieces;
+}
+
+bool ScratchSpace::aligned(const std::vector<Extent>& pieces, const void* buf) const {
+    if (!direct_ || reinterpret_cast<uintptr_t>(buf) % DIRECT_ALIGN != 0) return false;
+    for (const Extent& p : pieces)
+        if (files_[p.file].directFd < 0 || p.offset % DIRECT_ALIGN != 0 ||
+            p.bytes % DIRECT_ALIGN != 0)
+            return false;
+    return true;
+}
+
+size_t ScratchSpace::readPieces(const std::vector<Extent>& pieces, void* dst) const {
+    bool direct = aligned(pieces, dst);
+    char* p = static_cast<char*>(dst);
+    size_t done = 0;
+    for (const Extent& e : pieces) {
+        const File& f = files_[e.file];
+        size_t got = readFullyAt(direct ? f.directFd : f.fd, p + done, e.bytes, e.offset);
+        done += got;
+        if (got < e.bytes) break;
+    }
+    return done;
+}
+
+void ScratchSpace::writePieces(const std::vector<Extent>& pieces, const void* src) const {
+    bool direct = aligned(pieces, src);
+    const char* p = static_cast<const char*>(src);
+    for (const Extent& e : pieces) {
+        const File& f = files_[e.file];
+        writeFullyAt(direct ? f.directFd : f.fd, p, e.bytes, e.offset);
+        p += e.bytes;
+    }
+}
+
+size_t ScratchSpace::read(const ScratchRun& run, uint64_t offset, void* dst, size_t bytes) const {
+    if (offset >= run.bytes) return 0;
+    bytes = std::min<uint64_t>(bytes, run.bytes - offset);
+    return readPieces(locate(run, offset, bytes), dst);
+}
+
+void ScratchSpace::append(ScratchRun& run, const void* src, size_t bytes) {
+    reserve(run, run.bytes + bytes);
+    writePieces(locate(run, run.bytes, bytes), src);
+    run.bytes += bytes;
+}
+
+uint64_t ScratchSpace::reservedBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t total = 0;
+    for (auto& f : files_) total += f.reserved;
+    return total;
+}
+
+uint64_t ScratchSpace::peakBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_;
+}
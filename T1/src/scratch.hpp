@@ -0,0 +1,140 @@
+#ifndef SCRATCH_HPP
+#define SCRATCH_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "sort_options.hpp"
+
+class ThreadPool;
+
+// A byte range of one of the scratch files
+struct Extent {
+    uint32_t file = 0;      // Index of the scratch file (one per directory)
+    uint64_t offset = 0;
+    uint64_t bytes = 0;
+};
+
+// A temporary run or partition: a byte stream stored in scratch extents
+// (all of ScratchSpace::extentBytes(), on the same file) instead of a file
+// of its own
+struct ScratchRun {
+    uint32_t file = 0;
+    std::vector<Extent> extents;
+    uint64_t bytes = 0;     // Bytes written; the extents may hold more
+
+    // Number of int64_t values, for runs of plain values
+    uint64_t size() const { return bytes / sizeof(int64_t); }
+};
+
+// Scratch space of a sort: one temporary file per directory, preallocated
+// with fallocate and handed out in fixed-size extents that are reused once
+// released. The files are created unlinked (O_TMPFILE), so they disappear
+// when the space is destroyed, on exceptions and even if the process dies.
+// With 'direct', aligned reads and writes bypass the page cache (O_DIRECT);
+// unaligned ones quietly go through the cache. Each directory is taken as
+// a device of its own: runs are striped across them, and with several the
+// asynchronous transfers of each file go through a queue of its own, so
+// the devices work in parallel and a slow one holds back only its streams.
+class ScratchSpace {
+public:
+    // Alignment of O_DIRECT transfers: offsets, lengths and buffer addresses
+    static constexpr size_t DIRECT_ALIGN = 4096;
+    // Threads of the I/O queue of each device, when there are several
+    static constexpr size_t IO_THREADS_PER_FILE = 4;
+
+    ScratchSpace(const std::vector<std::string>& dirs, size_t extentBytes,
+                 uint64_t reserveBytes = 0, bool direct = false);
+    ~ScratchSpace();
+    ScratchSpace(const ScratchSpace&) = delete;
+    ScratchSpace& operator=(const ScratchSpace&) = delete;
+
+    // Directories a sort of 'inFile' spills to: opts.scratchDirs, or the
+    // input's directory ("." for stdin)
+    static std::vector<std::string> dirsFor(const std::string& inFile, const SortOptions& opts);
+
+    // Space for sorting 'inFile' within memBytes: in opts.scratchDirs (or
+    // the input's directory), reserved for the size of the input
+    static ScratchSpace forSort(const std::string& inFile, size_t memBytes,
+                                const SortOptions& opts);
+
+    // Extent size for a memory budget M: a few extents per M keep streams
+    // sequential, and the partly filled last extent of each stream wastes little
+    static size_t extentBytesFor(size_t memBytes);
+
+    size_t extentBytes() const { return extentBytes_; }
+    size_t files() const { return writable_; }
+    // True when O_DIRECT was requested and the file system accepted it
+    bool direct() const { return direct_; }
+
+    // Empty run placed on the next file, round-robin
+    ScratchRun newRun();
+    // Empty run on the next file other than 'file', round-robin (on 'file'
+    // itself when it is the only one), so a run is written to another
+    // device than the one it is made from
+    ScratchRun newRunApart(uint32_t file);
+
+    // Registers an existing file (the input) as a read-only source, for runs
+    // that are read in place; call before the space is shared between threads
+    uint32_t addSource(const std::string& filename);
+
+    // Run made of bytes [offset, offset + bytes) of a source, left where they
+    // are: reads work as on any run, while release() and writes never touch it
+    ScratchRun inPlace(uint32_t source, uint64_t offset, uint64_t bytes) const;
+
+    // Adds extents to 'run' until it can hold 'bytes' bytes
+    void reserve(ScratchRun& run, uint64_t bytes);
+
+    // Gives the run's extents back for reuse
+    void release(const ScratchRun& run);
+
+    // Pieces of the scratch files holding bytes [offset, offset + bytes) of 'run'
+    std::vector<Extent> locate(const ScratchRun& run, uint64_t offset, uint64_t bytes) const;
+
+    // Transfers between memory and the located pieces, in order; the read
+    // returns the bytes read
+    size_t readPieces(const std::vector<Extent>& pieces, void* dst) const;
+    void writePieces(const std::vector<Extent>& pieces, const void* src) const;
+
+    // Synchronous helpers: read within the written part of a run, or append to it
+    size_t read(const ScratchRun& run, uint64_t offset, void* dst, size_t bytes) const;
+    void append(ScratchRun& run, const void* src, size_t bytes);
+
+    // Descriptor of a file through the page cache (for mmap)
+    int fd(uint32_t file) const { return files_[file].fd; }
+
+    // Queue for the asynchronous transfers of a file: its own with several
+    // scratch files, else (and for sources) the shared ioThreadPool()
+    ThreadPool& ioPool(uint32_t file) const;
+
+    // Bytes of file space allocated so far, and the most ever handed out at once
+    uint64_t reservedBytes() const;
+    uint64_t peakBytes() const;
+
+private:
+    struct File {
+        int fd = -1;
+        int directFd = -1;          // Same file opened with O_DIRECT, or -1
+        uint64_t end = 0;           // Bytes ever carved into extents
+        uint64_t reserved = 0;      // Bytes allocated with fallocate
+        std::vector<uint64_t> free; // Offsets of released extents
+        bool source = false;        // Read-only file added with addSource
+    };
+
+    Extent allocate(uint32_t file);
+    bool aligned(const std::vector<Extent>& pieces, const void* buf) const;
+
+    size_t extentBytes_;
+    bool direct_;
+    std::vector<File> files_;       // Scratch files, then sources
+    size_t writable_;
+    std::vector<std::unique_ptr<ThreadPool>> ioPools_;  // Per scratch file, when several
+    mutable std::mutex mutex_;
+    uint32_t nextFile_ = 0;
+    uint64_t inUse_ = 0, peak_ = 0;
+};
+
+#endif // SCRATCH_HPP
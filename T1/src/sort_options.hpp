@@ -0,0 +1,49 @@
+#ifndef SORT_OPTIONS_HPP
+#define SORT_OPTIONS_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Default disk block size B in bytes
+constexpr size_t DEFAULT_BLOCK_SIZE = 4096;
+
+// How createInitialRuns forms sorted runs
+enum class RunFormation {
+    Sort,                 // Fill memory, sort, write: runs of exactly M bytes
+    ReplacementSelection, // Stream input through a heap: runs of ~2M bytes on random input
+    Natural               // Keep the input's sorted stretches: one run for sorted input
+};
+
+// Kernel used to sort memory-resident buffers
+enum class InMemorySort {
+    Auto,   // Radix for large buffers, else the fastest comparison kernel
+    Std,    // std::sort (introsort)
+    Simd,   // AVX2 vectorized quicksort with a bitonic sorting network for the leaves
+    Radix   // In-place MSD radix sort (American flag) on sign-flipped key bytes
+};
+
+// Tuning knobs shared by the external sorts
+struct SortOptions {
+    size_t blockBytes = DEFAULT_BLOCK_SIZE; // Disk block size B
+    RunFormation runFormation = RunFormation::Sort;
+    size_t ioDepth = 1;     // Buffers per stream; > 1 overlaps disk I/O with computation
+    size_t threads = 1;     // Worker threads for the CPU-bound phases
+    InMemorySort inMemorySort = InMemorySort::Auto;
+    bool mapPopulate = false;   // Prefault memory-mapped inputs (MAP_POPULATE)
+    bool mapHugePages = false;  // Ask for transparent huge pages on memory-mapped inputs
+    size_t sampleBlocks = 256;  // Random B-sized blocks read to choose pivots; 0 samples every value
+    uint64_t seed = 1;          // Seed of the pivot sampler, fixed so runs are reproducible
+    bool packRuns = false;      // Store mergesort's intermediate runs delta + bit-packed
+    std::vector<std::string> scratchDirs;  // Directories for runs and partitions; empty = the input's
+    bool directIo = false;      // Scratch I/O with O_DIRECT, bypassing the page cache
+    // Selection pushed into the sort: only the output is affected, and
+    // dropped values never reach runs or partitions
+    uint64_t limit = 0;             // Top-K: keep the 'limit' smallest values; 0 keeps all
+    int64_t minKey = INT64_MIN;     // Keep only values in [minKey, maxKey]
+    int64_t maxKey = INT64_MAX;
+    bool distinct = false;          // Keep one copy of each value
+};
+
+#endif // SORT_OPTIONS_HPP
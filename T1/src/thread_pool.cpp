@@ -0,0 +1,152 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <utility>
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) threads = 1;
+    for (size_t i = 0; i < threads; ++i)
+        workers_.emplace_back([this]() { work(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    ready_.notify_all();
+    for (auto& t : workers_) t.join();
+}
+
+void ThreadPool::work() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            task = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        task();
+    }
+}
+
+namespace {
+
+// Worker index of the calling thread within the pool it belongs to
+thread_local const WorkStealingPool* currentPool = nullptr;
+thread_local size_t currentWorker = 0;
+
+} // namespace
+
+WorkStealingPool::WorkStealingPool(size_t threads) {
+    if (threads == 0) threads = 1;
+    for (size_t i = 0; i < threads; ++i)
+        queues_.push_back(std::make_unique<Queue>());
+    for (size_t i = 0; i < threads; ++i)
+        workers_.emplace_back([this, i]() { work(i); });
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    ready_.notify_all();
+    for (auto& t : workers_) t.join();
+}
+
+void WorkStealingPool::spawn(std::function<void()> task) {
+    size_t target;
+    {
+        // Counted before it is visible, so 'queued_' never runs below zero
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++queued_;
+        ++pending_;
+        target = currentPool == this ? currentWorker : nextQueue_++ % queues_.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues_[target]->mutex);
+        queues_[target]->tasks.push_back([task = std::move(task), phase = currentPhase(),
+                                          arena = currentArena()]() {
+            PhaseScope scope(phase);
+            ArenaScope charged(arena);
+            task();
+        });
+    }
+    ready_.notify_one();
+}
+
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this]() { return pending_ == 0; });
+    if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+}
+
+bool WorkStealingPool::take(size_t self, std::function<void()>& task) {
+    size_t n = queues_.size();
+    for (size_t i = 0; i < n; ++i) {
+        Queue& q = *queues_[(self + i) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.tasks.empty()) continue;
+        // Own work LIFO, stolen work FIFO
+        if (i == 0) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        } else {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::work(size_t self) {
+    currentPool = this;
+    currentWorker = self;
+    while (true) {
+        std::function<void()> task;
+        if (take(self, task)) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --queued_;
+            }
+            std::exception_ptr failure;
+            try {
+                task();
+            } catch (...) {
+                failure = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (failure && !error_) error_ = failure;
+            if (--pending_ == 0) idle_.notify_all();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [this]() { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0) return;
+    }
+}
+
+size_t MemoryBudget::acquire(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bytes = std::min(bytes, limit_);
+    freed_.wait(lock, [&]() { return used_ + bytes <= limit_; });
+    used_ += bytes;
+    return bytes;
+}
+
+void MemoryBudget::release(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_ -= bytes;
+    }
+    freed_.notify_all();
+}
+
+ThreadPool& ioThreadPool() {
+    // Blocking syscalls: more threads than cores keeps the device queue busy
+    static ThreadPool pool(std::max(8u, std::thread::hardware_concurrency()));
+    return pool;
+}
@@ -0,0 +1,130 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#include "io_stats.hpp"
+#include "memory_arena.hpp"
+
+// Fixed set of worker threads draining a FIFO task queue
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queues 'fn' and returns a future for its result (exceptions travel through it).
+    // The task runs in the I/O accounting phase and the memory arena of the caller.
+    template<typename F>
+    auto submit(F fn) -> std::future<std::invoke_result_t<F>> {
+        using R = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.emplace_back([task, phase = currentPhase(), arena = currentArena()]() {
+                PhaseScope scope(phase);
+                ArenaScope charged(arena);
+                (*task)();
+            });
+        }
+        ready_.notify_one();
+        return result;
+    }
+
+    size_t size() const { return workers_.size(); }
+
+private:
+    void work();
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> queue_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    bool stop_ = false;
+};
+
+// Pool for recursive task trees. Each worker runs the newest task of its own
+// deque first (depth-first, cache-warm) and, when it runs dry, steals the
+// oldest task of another worker, which tends to be the largest subproblem.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(size_t threads);
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Queues 'task'; from inside a task it lands on the calling worker's deque.
+    // The task runs in the I/O accounting phase and the memory arena of the caller.
+    void spawn(std::function<void()> task);
+
+    // Blocks until all spawned tasks, including the ones they spawned, have
+    // finished; rethrows the first exception a task threw
+    void wait();
+
+    size_t size() const { return workers_.size(); }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool take(size_t self, std::function<void()>& task);
+    void work(size_t self);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable ready_, idle_;
+    size_t queued_ = 0;     // Tasks sitting in some deque
+    size_t pending_ = 0;    // Tasks queued or running
+    size_t nextQueue_ = 0;  // Round robin for spawns from outside the pool
+    bool stop_ = false;
+    std::exception_ptr error_;
+};
+
+// Byte budget shared by concurrent tasks: acquire() blocks until the bytes
+// fit under the limit. Requests larger than the limit are clamped to it.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(size_t limit) : limit_(limit) {}
+
+    size_t acquire(size_t bytes);
+    void release(size_t bytes);
+
+    // Holds 'bytes' of the budget for the lifetime of the lease
+    class Lease {
+    public:
+        Lease(MemoryBudget* budget, size_t bytes)
+            : budget_(budget), bytes_(budget ? budget->acquire(bytes) : 0) {}
+        ~Lease() { if (budget_) budget_->release(bytes_); }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+    private:
+        MemoryBudget* budget_;
+        size_t bytes_;
+    };
+
+private:
+    std::mutex mutex_;
+    std::condition_variable freed_;
+    size_t limit_;
+    size_t used_ = 0;
+};
+
+// Shared pool that runs the blocking disk reads and writes issued asynchronously
+ThreadPool& ioThreadPool();
+
+#endif // THREAD_POOL_HPP
@@ -3,7 +3,24 @@
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <random>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include "../src/autotune.hpp"
 #include "../src/external_mergesort.hpp"
+#include "../src/external_sort.hpp"
+#include "../src/io_stats.hpp"
+#include "../src/memory_arena.hpp"
+#include "../src/run_codec.hpp"
+
+// 64-byte record: 16-byte key followed by a payload that must travel with it
+struct KeyedRecord {
+    std::array<uint64_t, 2> key;
+    char payload[48];
+};
 
 // Helper: write a vector of int64_t to a binary file
 void writeBinary(const std::string& filename, const std::vector<int64_t>& data) {
@@ -21,6 +38,13 @@ std::vector<int64_t> readBinary(const std::string& filename) {
     return data;
 }
 
+// Helper: read a scratch run of plain int64_t values
+std::vector<int64_t> readRun(const ScratchSpace& scratch, const ScratchRun& run) {
+    std::vector<int64_t> data(run.size());
+    RunReader(scratch, run, 4096).read(data.data(), data.size());
+    return data;
+}
+
 int main() {
     // Test data
     std::vector<int64_t> v = {9,1,8,2,7,3,6,4,5,0};
@@ -39,5 +63,504 @@ int main() {
     assert(sorted == expect && "externalMergesort failed to sort!");
 
     std::cout << "[OK] externalMergesort sorted correctly.\n";
+
+    // Larger input: runs and merge buffers span many blocks and several passes
+    std::vector<int64_t> big(100000);
+    std::mt19937_64 rng(42);
+    for (auto& x : big) x = static_cast<int64_t>(rng());
+    writeBinary(inputFile, big);
+    externalMergesort(inputFile, outputFile, 64 * 1024, 4, SortOptions{4096});
+    auto bigExpect = big;
+    std::sort(bigExpect.begin(), bigExpect.end());
+    assert(readBinary(outputFile) == bigExpect && "buffered merge failed to sort!");
+
+    std::cout << "[OK] externalMergesort sorted a multi-pass input correctly.\n";
+
+    // Instrumentation: every phase moves the whole input once in each direction
+    resetIoStats();
+    externalMergesort(inputFile, outputFile, 64 * 1024, 4, SortOptions{4096});
+    const uint64_t bigBytes = big.size() * sizeof(int64_t);
+    auto phases = ioReport();
+    std::vector<std::string> names;
+    for (auto& p : phases) {
+        names.push_back(p.name);
+        assert(p.read.bytes == bigBytes && p.write.bytes == bigBytes && "phase I/O miscounted!");
+        assert(p.read.blocks >= bigBytes / 4096 && p.read.calls > 0 && p.seconds > 0);
+    }
+    assert((names == std::vector<std::string>{"run formation", "merge pass 0", "merge pass 1"}));
+    assert(ioTotals().write.blocks >= 3 * bigBytes / 4096);
+    assert(ioStatsJson().find("\"merge pass 1\"") != std::string::npos);
+
+    // Resident memory is sampled per phase: a phase after a freed 64MB
+    // buffer doesn't inherit the process peak
+    resetIoStats();
+    {
+        std::vector<char> ballast(size_t(64) << 20, 1);
+        PhaseScope scope("ballast");
+    }
+    { PhaseScope scope("after ballast"); }
+    uint64_t ballastPeak = 0, afterPeak = 0;
+    for (auto& p : ioReport()) {
+        if (p.name == "ballast") ballastPeak = p.peakMemoryBytes;
+        if (p.name == "after ballast") afterPeak = p.peakMemoryBytes;
+    }
+    assert(ballastPeak >= (size_t(64) << 20) && afterPeak + (size_t(32) << 20) < ballastPeak);
+
+    std::cout << "[OK] I/O counted per phase.\n";
+
+    // Loser tree merges: odd arities, a single high-arity pass, and heavy duplicates
+    for (auto& x : big) x %= 1000;
+    bigExpect = big;
+    std::sort(bigExpect.begin(), bigExpect.end());
+    writeBinary(inputFile, big);
+    for (int arity : {2, 7, 256}) {
+        externalMergesort(inputFile, outputFile, 8 * 1024, arity, SortOptions{4096});
+        assert(readBinary(outputFile) == bigExpect && "loser tree merge failed to sort!");
+    }
+
+    std::cout << "[OK] externalMergesort merged correctly at arities 2, 7 and 256.\n";
+
+    // Replacement selection: ~2M runs on random input, a single run on sorted input
+    SortOptions rs{4096, RunFormation::ReplacementSelection};
+    const size_t rsMem = 64 * 1024;
+    for (auto& x : big) x = static_cast<int64_t>(rng());
+    writeBinary(inputFile, big);
+    ScratchSpace scratch({"test"}, 64 * 1024);
+    auto rsRuns = createInitialRuns(inputFile, rsMem, scratch, rs);
+    assert(rsRuns.size() < big.size() * sizeof(int64_t) / rsMem && "runs are not longer than M!");
+    mergeRuns(rsRuns, outputFile, rsMem, 8, scratch, rs);
+    bigExpect = big;
+    std::sort(bigExpect.begin(), bigExpect.end());
+    assert(readBinary(outputFile) == bigExpect && "replacement selection failed to sort!");
+
+    writeBinary(inputFile, bigExpect);
+    rsRuns = createInitialRuns(inputFile, rsMem, scratch, rs);
+    assert(rsRuns.size() == 1 && "sorted input must form a single run!");
+    assert(readRun(scratch, rsRuns[0]) == bigExpect);
+    scratch.release(rsRuns[0]);
+
+    std::cout << "[OK] replacement selection formed long runs correctly.\n";
+
+    // Natural runs: sorted input is one run read in place (nothing written),
+    // an appended tail adds only a few runs, other shapes still sort
+    SortOptions natural{4096, RunFormation::Natural};
+    {
+        ScratchSpace nat({"test"}, 64 * 1024);
+        auto runs = createInitialRuns(inputFile, rsMem, nat, natural);
+        assert(runs.size() == 1 && nat.peakBytes() == 0 && "sorted input was copied!");
+        assert(readRun(nat, runs[0]) == bigExpect);
+        nat.release(runs[0]);
+
+        std::vector<int64_t> appended = bigExpect;
+        for (int i = 0; i < 5000; ++i) appended.push_back(static_cast<int64_t>(rng()));
+        writeBinary(inputFile, appended);
+        runs = createInitialRuns(inputFile, rsMem, nat, natural);
+        assert(runs.size() <= 3 && "appended tail was not kept apart!");
+        mergeRuns(runs, outputFile, rsMem, 4, nat, natural);
+        std::sort(appended.begin(), appended.end());
+        assert(readBinary(outputFile) == appended && "natural runs failed to merge!");
+    }
+    std::vector<int64_t> shaped = bigExpect;
+    std::reverse(shaped.begin() + shaped.size() / 3, shaped.end());
+    std::reverse(shaped.begin(), shaped.begin() + 1000);
+    for (size_t i = 2000; i < 2100; ++i) shaped[i] = static_cast<int64_t>(rng());
+    auto shapedExpect = shaped;
+    std::sort(shapedExpect.begin(), shapedExpect.end());
+    for (int variant = 0; variant < 3; ++variant) {
+        std::vector<int64_t> in = variant == 2 ? big : shaped;
+        SortOptions opt = natural;
+        opt.packRuns = variant == 1;
+        writeBinary(inputFile, in);
+        externalMergesort(inputFile, outputFile, rsMem, 4, opt);
+        assert(readBinary(outputFile) == (variant == 2 ? bigExpect : shapedExpect) &&
+               "natural runs failed to sort!");
+    }
+    writeBinary(inputFile, big);
+
+    std::cout << "[OK] natural runs kept sorted stretches in place.\n";
+
+    // Asynchronous prefetch and write-behind, for both run formation modes
+    writeBinary(inputFile, big);
+    for (RunFormation mode : {RunFormation::Sort, RunFormation::ReplacementSelection}) {
+        SortOptions async{4096, mode, 3};
+        externalMergesort(inputFile, outputFile, 64 * 1024, 4, async);
+        assert(readBinary(outputFile) == bigExpect && "async I/O failed to sort!");
+    }
+
+    std::cout << "[OK] externalMergesort sorted correctly with async I/O.\n";
+
+    // Parallel run formation, concurrent group merges and a key-range split
+    // final merge, also with many copies of the splitter keys
+    SortOptions parallel;
+    parallel.threads = 4;
+    for (int round = 0; round < 2; ++round) {
+        if (round == 1) {
+            for (auto& x : big) x %= 50;
+            bigExpect = big;
+            std::sort(bigExpect.begin(), bigExpect.end());
+            writeBinary(inputFile, big);
+        }
+        externalMergesort(inputFile, outputFile, 64 * 1024, 4, parallel);
+        assert(readBinary(outputFile) == bigExpect && "parallel mergesort failed to sort!");
+    }
+
+    std::cout << "[OK] externalMergesort sorted correctly with 4 threads.\n";
+
+    // Packed run format: blocks round-trip for sorted, constant, unsorted and extreme values
+    std::mt19937_64 packGen(3);
+    for (int shape = 0; shape < 4; ++shape) {
+        std::vector<int64_t> vals(2500);
+        for (size_t i = 0; i < vals.size(); ++i)
+            vals[i] = shape == 0 ? static_cast<int64_t>(i * 3 + packGen() % 3)
+                    : shape == 1 ? 42
+                    : shape == 2 ? static_cast<int64_t>(packGen())
+                    : (i % 2 ? INT64_MAX : INT64_MIN);
+        std::vector<unsigned char> enc(packedBound(vals.size()));
+        size_t bytes = packValues(vals.data(), vals.size(), enc.data());
+        std::vector<int64_t> dec;
+        for (size_t at = 0; at < bytes;) {
+            PackedHeader h;
+            std::memcpy(&h, enc.data() + at, sizeof(h));
+            dec.resize(dec.size() + h.count);
+            unpackBlock(enc.data() + at, dec.data() + dec.size() - h.count);
+            at += packedBlockBytes(h);
+        }
+        assert(dec == vals && "Packed block did not round-trip!");
+    }
+
+    // Packed intermediate runs are much smaller, and the result is plain int64_t
+    SortOptions packed{4096};
+    packed.packRuns = true;
+    auto packedRuns = createInitialRuns(inputFile, 64 * 1024, scratch, packed);
+    assert(packedRuns[0].bytes * 3 < 64 * 1024 && "Sorted run did not compress!");
+    for (auto& r : packedRuns) scratch.release(r);
+    for (int variant = 0; variant < 3; ++variant) {
+        SortOptions opts = packed;
+        if (variant == 1) opts.ioDepth = 3;
+        if (variant == 2) opts.threads = 4;
+        externalMergesort(inputFile, outputFile, 64 * 1024, 4, opts);
+        assert(readBinary(outputFile) == bigExpect && "Packed runs failed to sort!");
+    }
+    writeBinary(inputFile, bigExpect);
+    packed.runFormation = RunFormation::ReplacementSelection;
+    externalMergesort(inputFile, outputFile, 64 * 1024, 4, packed);
+    assert(readBinary(outputFile) == bigExpect && "A single packed run must be decoded!");
+
+    std::cout << "[OK] externalMergesort sorted correctly with packed runs.\n";
+
+    // Scratch space: merged runs hand their extents to the next pass, so a
+    // 9-pass merge needs about twice the input, not ten times
+    for (auto& x : big) x = static_cast<int64_t>(rng());
+    bigExpect = big;
+    std::sort(bigExpect.begin(), bigExpect.end());
+    writeBinary(inputFile, big);
+    {
+        ScratchSpace reuse({"test"}, 4096);
+        // M holds the input and run streams (a block each) besides 2048 bytes of values
+        auto runs = createInitialRuns(inputFile, 3072, reuse, SortOptions{512});
+        assert(runs.size() == 391);
+        mergeRuns(runs, outputFile, 3072, 2, reuse, SortOptions{512});
+        assert(readBinary(outputFile) == bigExpect && "scratch merge failed to sort!");
+        assert(runs.empty() && reuse.reservedBytes() <= 3 * bigBytes && "extents were not reused!");
+    }
+
+    // O_DIRECT scratch (aligned buffers, padded last blocks), alone and with
+    // packed runs and async I/O mixed in
+    for (int variant = 0; variant < 3; ++variant) {
+        SortOptions direct{4096};
+        direct.directIo = true;
+        direct.packRuns = variant == 1;
+        direct.ioDepth = variant == 2 ? 3 : 1;
+        externalMergesort(inputFile, outputFile, 64 * 1024 + 8, 4, direct);
+        assert(readBinary(outputFile) == bigExpect && "direct I/O scratch failed to sort!");
+    }
+
+    // Nothing is left behind, even when the sort fails half-way
+    auto entries = [] {
+        size_t n = 0;
+        for (auto& e : std::filesystem::directory_iterator("test")) n += e.is_regular_file();
+        return n;
+    };
+    size_t before = entries();
+    bool threw = false;
+    try {
+        externalMergesort(inputFile, "test/missing/out.bin", 64 * 1024, 4, SortOptions{4096});
+    } catch (const std::exception&) {
+        threw = true;
+    }
+    assert(threw && entries() == before && "scratch files were left behind!");
+
+    std::cout << "[OK] Scratch extents were reused and cleaned up.\n";
+    // Streaming: pushes of odd sizes spill runs, and the last merge is pulled
+    // lazily; plain + next() with several passes, packed + threads + read()
+    for (int variant = 0; variant < 2; ++variant) {
+        SortOptions streamOpts{4096};
+        streamOpts.scratchDirs = {"test"};
+        streamOpts.packRuns = variant == 1;
+        streamOpts.threads = variant == 1 ? 2 : 1;
+        StreamingSorter sorter(16 * 1024, 3, streamOpts);
+        for (size_t i = 0; i < big.size(); i += 1000)
+            sorter.push(big.data() + i, std::min<size_t>(1000, big.size() - i));
+        SortedStream stream = sorter.finish();
+        std::vector<int64_t> pulled(big.size());
+        if (variant == 0) {
+            size_t k = 0;
+            int64_t x;
+            while (stream.next(x)) {
+                assert(k < pulled.size());
+                pulled[k++] = x;
+            }
+            assert(k == pulled.size());
+        } else {
+            size_t got = stream.read(pulled.data(), pulled.size());
+            assert(got == pulled.size());
+            int64_t x;
+            bool more = stream.next(x);
+            assert(!more);
+        }
+        assert(pulled == bigExpect && "streaming sorter failed to sort!");
+    }
+    {
+        StreamingSorter sorter(1024 * 1024, 4);
+        sorter.push(v);
+        SortedStream stream = sorter.finish();
+        std::vector<int64_t> pulled(v.size() + 1);
+        size_t got = stream.read(pulled.data(), pulled.size());
+        assert(got == v.size());
+        pulled.pop_back();
+        assert(pulled == expect && "in-memory streaming sort failed!");
+    }
+    // The binary's "-" mode: stdin to stdout through a pipe, and an input
+    // that ends inside a value fails instead of dropping the tail
+    writeBinary(inputFile, big);
+    int status = std::system(("cat " + inputFile + " | bin/mergesort - - 16384 3 > test/stream_output.bin")
+                                 .c_str());
+    assert(status == 0 && readBinary("test/stream_output.bin") == bigExpect && "stdin/stdout mode failed!");
+    status = std::system(("(head -c 8003 " + inputFile +
+                          " | bin/mergesort - test/stream_output.bin 16384 3) 2>/dev/null").c_str());
+    assert(status != 0 && "a partial trailing value was dropped!");
+    std::remove("test/stream_output.bin");
+    std::cout << "[OK] StreamingSorter merged pushed values lazily.\n";
+
+    // Selection fused into the sort: top-K in memory and through runs cut
+    // to K, a key range dropped at ingest, distinct values in every pass
+    std::vector<int64_t> dups(big.size());
+    for (auto& x : dups) x = static_cast<int64_t>(rng() % 20000) - 10000;
+    writeBinary(inputFile, dups);
+    std::sort(dups.begin(), dups.end());
+    for (uint64_t limit : {100, 40000}) {
+        for (int mode = 0; mode < 3; ++mode) {
+            SortOptions sel{4096, mode == 1 ? RunFormation::ReplacementSelection : RunFormation::Sort};
+            sel.threads = mode == 2 ? 2 : 1;
+            sel.limit = limit;
+            externalMergesort(inputFile, outputFile, 64 * 1024, 3, sel);
+            assert(readBinary(outputFile) == std::vector<int64_t>(dups.begin(), dups.begin() + limit) &&
+                   "top-K failed!");
+            sel.limit = 0;
+            sel.distinct = true;
+            sel.minKey = -5000;
+            sel.maxKey = 5000;
+            ScratchSpace selScratch({"test"}, 64 * 1024);
+            auto selRuns = createInitialRuns(inputFile, 64 * 1024, selScratch, sel);
+            for (auto& r : selRuns) {
+                auto values = readRun(selScratch, r);
+                assert(std::adjacent_find(values.begin(), values.end()) == values.end() &&
+                       values.front() >= -5000 && values.back() <= 5000 && "runs kept dropped values!");
+            }
+            mergeRuns(selRuns, outputFile, 64 * 1024, 3, selScratch, sel);
+            std::vector<int64_t> expectDistinct;
+            for (int64_t x : dups)
+                if (x >= -5000 && x <= 5000 && (expectDistinct.empty() || expectDistinct.back() != x))
+                    expectDistinct.push_back(x);
+            assert(readBinary(outputFile) == expectDistinct && "distinct range failed!");
+        }
+    }
+    {
+        SortOptions sel{4096};
+        sel.distinct = true;
+        sel.limit = 500;
+        StreamingSorter sorter(16 * 1024, 3, sel);
+        sorter.push(dups);
+        SortedStream stream = sorter.finish();
+        std::vector<int64_t> pulled(1000);
+        pulled.resize(stream.read(pulled.data(), pulled.size()));
+        std::vector<int64_t> expectFirst(dups.begin(), std::unique(dups.begin(), dups.end()));
+        expectFirst.resize(500);
+        assert(pulled == expectFirst && "streaming selection failed!");
+    }
+    writeBinary(inputFile, big);
+
+    std::cout << "[OK] Top-K, key range and distinct modes cut the sort short.\n";
+
+    // Generic records: sorted by key alone across several runs and merge
+    // passes; 400 keys shared by 20000 records that each carry a unique id
+    std::mt19937_64 recGen(7);
+    std::vector<KeyedRecord> recs(20000);
+    for (uint64_t id = 0; id < recs.size(); ++id) {
+        KeyedRecord& r = recs[id];
+        r.key = {recGen() % 100, recGen() % 4};
+        std::memcpy(r.payload, &r.key, sizeof(r.key));
+        std::memcpy(r.payload + sizeof(r.key), &id, sizeof(id));
+        std::memset(r.payload + sizeof(r.key) + sizeof(id), static_cast<int>(id & 0x7F),
+                    sizeof(r.payload) - sizeof(r.key) - sizeof(id));
+    }
+    {
+        std::ofstream out(inputFile, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(recs.data()), recs.size() * sizeof(KeyedRecord));
+    }
+    auto byKey = [](const KeyedRecord& r) { return r.key; };
+    externalSort<KeyedRecord>(inputFile, outputFile, 64 * 1024, 3, SortOptions{4096}, byKey);
+    std::vector<KeyedRecord> recSorted(recs.size() + 1);
+    {
+        std::ifstream in(outputFile, std::ios::binary);
+        in.read(reinterpret_cast<char*>(recSorted.data()), recSorted.size() * sizeof(KeyedRecord));
+        assert(static_cast<size_t>(in.gcount()) == recs.size() * sizeof(KeyedRecord));
+    }
+    recSorted.pop_back();
+    for (size_t i = 0; i < recSorted.size(); ++i) {
+        assert((i == 0 || recSorted[i - 1].key <= recSorted[i].key) && "records out of order!");
+        assert(std::memcmp(recSorted[i].payload, &recSorted[i].key, sizeof(recSorted[i].key)) == 0 &&
+               "payload separated from its key!");
+    }
+    // Whole records, compared byte for byte: the output is a permutation of the input
+    auto byBytes = [](const KeyedRecord& a, const KeyedRecord& b) {
+        return std::memcmp(&a, &b, sizeof(KeyedRecord)) < 0;
+    };
+    std::sort(recs.begin(), recs.end(), byBytes);
+    std::sort(recSorted.begin(), recSorted.end(), byBytes);
+    assert(std::memcmp(recs.data(), recSorted.data(), recs.size() * sizeof(KeyedRecord)) == 0 &&
+           "records lost, duplicated or mixed up!");
+    // A file that ends inside a record is rejected, not cut short
+    {
+        std::ofstream out(inputFile, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(recs.data()), 100 * sizeof(KeyedRecord) - 5);
+    }
+    bool rejected = false;
+    try {
+        externalSort<KeyedRecord>(inputFile, outputFile, 64 * 1024, 3, SortOptions{4096}, byKey);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected && "a partial trailing record was dropped!");
+
+    // Custom comparator on int64_t takes the generic path; the default one the specialized path
+    writeBinary(inputFile, big);
+    externalSort<int64_t, IdentityKey, std::greater<>>(inputFile, outputFile, 64 * 1024, 4);
+    std::reverse(bigExpect.begin(), bigExpect.end());
+    assert(readBinary(outputFile) == bigExpect && "descending externalSort failed!");
+    externalSort<int64_t>(inputFile, outputFile, 64 * 1024, 4);
+    std::reverse(bigExpect.begin(), bigExpect.end());
+    assert(readBinary(outputFile) == bigExpect && "int64_t externalSort failed!");
+
+    std::cout << "[OK] externalSort sorted fixed-size records by key.\n";
+    // Cost model on a synthetic profile: more memory never needs more
+    // passes, and slower seeks trade fan-in for bigger buffers
+    DeviceProfile hdd{4096, 150e6, 150e6, 8e-3, 3e-9, 2e-9};
+    DeviceProfile ssd = hdd;
+    ssd.randomReadSeconds = 80e-6;
+    const uint64_t n = 1ull << 27;   // 1GB of int64_t
+    SortPlan small = planSort(ssd, n, size_t(16) << 20, 4096);
+    SortPlan large = planSort(ssd, n, size_t(256) << 20, 4096);
+    assert(small.arity >= 2 && small.arity <= int((size_t(16) << 20) / 4096) - 1);
+    assert(large.mergePasses <= small.mergePasses && "more memory needed more passes!");
+    assert(large.mergePasses == 1 && large.arity == 4);   // 4 runs of 256MB
+    SortPlan seeky = planSort(hdd, n, size_t(16) << 20, 4096);
+    assert(seeky.arity <= small.arity && seeky.mergeBufferBytes >= small.mergeBufferBytes);
+    assert(small.parts >= 2 && small.quicksortLevels >= 1);
+    // Partitioning streams the input too: with M/B = 8, at most 7 parts
+    // (leaving it out picked 8)
+    SortPlan narrow = planSort(ssd, n, 8 * 4096, 4096);
+    assert(narrow.parts >= 2 && narrow.parts + 1 <= 8 && narrow.arity + 1 <= 8 &&
+           "the input stream was left out of M!");
+
+    hdd.probeDir = "scratch dir";
+    saveDeviceProfile("test/profile.txt", hdd);
+    DeviceProfile loaded;
+    bool found = loadDeviceProfile("test/profile.txt", loaded);
+    assert(found && loaded.blockBytes == 4096 && loaded.probeDir == hdd.probeDir &&
+           loaded.randomReadSeconds == hdd.randomReadSeconds &&
+           loaded.mergeSecondsPerLevel == hdd.mergeSecondsPerLevel && "profile round-trip failed!");
+    std::remove("test/profile.txt");
+    found = loadDeviceProfile("test/profile.txt", loaded);
+    assert(!found);
+
+    // Measured in the scratch directory with blocks above the 1MB probe
+    // chunk and above the 32MB probe file
+    for (size_t B : {size_t(2) << 20, size_t(48) << 20}) {
+        DeviceProfile measured = loadOrMeasureProfile("test/profile.txt", "test", B);
+        assert(measured.blockBytes == B && measured.probeDir == "test" &&
+               measured.randomReadSeconds > 0 && std::isfinite(measured.randomReadSeconds));
+    }
+    found = loadDeviceProfile("test/profile.txt", loaded);
+    assert(found && loaded.probeDir == "test" && loaded.blockBytes == size_t(48) << 20);
+    std::remove("test/profile.txt");
+
+    std::cout << "[OK] Cost model planned arity from a device profile.\n";
+
+    // Memory arena: every block is charged to the limit, one past it throws,
+    // freed space is reused, and blocks no hole fits still come (charged)
+    {
+        MemoryArena arena(64 * 1024);
+        void* a = arena.allocate(40 * 1024);
+        void* b = arena.allocate(100);
+        assert(reinterpret_cast<uintptr_t>(a) % 4096 == 0 && arena.inUse() == 40 * 1024 + 128);
+        bool threw = false;
+        try {
+            arena.allocate(32 * 1024);
+        } catch (const MemoryBudgetExceeded&) {
+            threw = true;
+        }
+        assert(threw && arena.inUse() == 40 * 1024 + 128 && "allocation past M was served!");
+        arena.deallocate(a, 40 * 1024);
+        assert(arena.allocate(40 * 1024) == a && "freed block was not reused!");
+        arena.deallocate(a, 40 * 1024);
+        void* c = arena.allocate(48 * 1024);    // Fits the budget, but no single hole
+        arena.deallocate(c, 48 * 1024);
+        {
+            ArenaScope scope(&arena);
+            IoBuffer buf(1024);
+            assert(arena.inUse() == 128 + 8192 && "IoBuffer was not charged to the arena!");
+        }
+        arena.deallocate(b, 100);
+        assert(arena.inUse() == 0 && arena.peak() == 48 * 1024 + 128);
+    }
+    // A sort keeps all of its buffers within M
+    SortOptions budgeted{4096};
+    budgeted.ioDepth = 2;
+    budgeted.packRuns = true;
+    resetIoStats();
+    externalMergesort(inputFile, outputFile, 64 * 1024, 16, budgeted);
+    assert(readBinary(outputFile) == bigExpect && "budgeted sort failed!");
+    uint64_t peak = ioTotals().peakBudgetBytes;
+    assert(peak > 0 && peak <= sortBudget(64 * 1024, budgeted) && "sort went past its budget!");
+
+    std::cout << "[OK] Memory arena held every buffer within M.\n";
+
+    // Striping over several scratch directories: runs alternate between
+    // them, and a run made from another goes to a different directory
+    std::vector<std::string> stripeDirs = {"test/stripe0", "test/stripe1", "test/stripe2"};
+    for (auto& d : stripeDirs) std::filesystem::create_directories(d);
+    {
+        ScratchSpace striped(stripeDirs, 64 * 1024);
+        assert(striped.files() == 3);
+        for (uint32_t f = 0; f < 3; ++f)
+            assert(striped.newRunApart(f).file != f && "run was placed on its source's directory!");
+        auto runs = createInitialRuns(inputFile, 64 * 1024, striped, SortOptions{4096});
+        std::vector<size_t> perDir(3, 0);
+        for (auto& r : runs) ++perDir[r.file];
+        auto spread = std::minmax_element(perDir.begin(), perDir.end());
+        assert(*spread.second - *spread.first <= 1 && "runs were not striped!");
+        mergeRuns(runs, outputFile, 64 * 1024, 4, striped, SortOptions{4096});
+        assert(readBinary(outputFile) == bigExpect && "striped merge failed to sort!");
+    }
+    SortOptions stripedOpts{4096};
+    stripedOpts.scratchDirs = stripeDirs;
+    stripedOpts.ioDepth = 2;
+    stripedOpts.threads = 2;
+    externalMergesort(inputFile, outputFile, 64 * 1024, 3, stripedOpts);
+    assert(readBinary(outputFile) == bigExpect && "striped externalMergesort failed to sort!");
+    for (auto& d : stripeDirs) std::filesystem::remove(d);
+
+    std::cout << "[OK] Runs were striped over several scratch directories.\n";
     return 0;
 }
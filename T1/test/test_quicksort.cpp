@@ -3,7 +3,12 @@
 #include <vector>
 #include <cassert>
 #include <algorithm>
+#include <random>
+#include <climits>
+#include <filesystem>
 #include "../src/external_quicksort.hpp"
+#include "../src/in_memory_sort.hpp"
+#include "../src/io_stats.hpp"
 
 // Helper: write vector<int64_t> to binary file
 void writeBinary(const std::string& filename, const std::vector<int64_t>& data) {
@@ -21,6 +26,13 @@ std::vector<int64_t> readBinary(const std::string& filename) {
     return data;
 }
 
+// Helper: read a scratch run of plain int64_t values
+std::vector<int64_t> readRun(const ScratchSpace& scratch, const ScratchRun& run) {
+    std::vector<int64_t> data(run.size());
+    RunReader(scratch, run, 4096).read(data.data(), data.size());
+    return data;
+}
+
 int main() {
     // Prepare test data
     std::vector<int64_t> data = {5, 3, 8, 1, 2, 7, 4, 6};
@@ -41,5 +53,261 @@ int main() {
     assert(sortedData == expected && "Sorted output does not match expected!");
 
     std::cout << "[OK] externalQuicksort sorted the data correctly.\n";
+
+    // Larger input: partitions are written through block buffers and recursed
+    std::vector<int64_t> big(100000);
+    std::mt19937_64 rng(42);
+    for (auto& x : big) x = static_cast<int64_t>(rng());
+    writeBinary(inputFile, big);
+    externalQuicksort(inputFile, outputFile, 64 * 1024, 8, SortOptions{4096});
+    std::vector<int64_t> bigExpected = big;
+    std::sort(bigExpected.begin(), bigExpected.end());
+    assert(readBinary(outputFile) == bigExpected && "Buffered partitioning lost data!");
+
+    std::cout << "[OK] externalQuicksort sorted a multi-level input correctly.\n";
+
+    // Same input with read-ahead and write-behind buffers
+    SortOptions async;
+    async.ioDepth = 2;
+    externalQuicksort(inputFile, outputFile, 64 * 1024, 8, async);
+    assert(readBinary(outputFile) == bigExpected && "Async partitioning lost data!");
+    async.directIo = true;
+    externalQuicksort(inputFile, outputFile, 64 * 1024, 8, async);
+    assert(readBinary(outputFile) == bigExpected && "O_DIRECT partitions lost data!");
+
+    std::cout << "[OK] externalQuicksort sorted correctly with async I/O.\n";
+
+    // Partitions sorted as stolen tasks under a shared memory budget, also
+    // with heavy duplication
+    SortOptions parallel;
+    parallel.threads = 4;
+    resetIoStats();
+    externalQuicksort(inputFile, outputFile, 64 * 1024, 8, parallel);
+    assert(readBinary(outputFile) == bigExpected && "Parallel quicksort failed to sort!");
+    uint64_t peak = ioTotals().peakBudgetBytes;
+    assert(peak > 0 && peak <= 64 * 1024 && "Tasks went past the memory budget!");
+    std::vector<int64_t> dups = big;
+    for (auto& x : dups) x %= 1000;
+    std::vector<int64_t> dupsExpected = dups;
+    std::sort(dupsExpected.begin(), dupsExpected.end());
+    writeBinary(inputFile, dups);
+    externalQuicksort(inputFile, outputFile, 64 * 1024, 8, parallel);
+    assert(readBinary(outputFile) == dupsExpected && "Parallel quicksort failed on duplicates!");
+    writeBinary(inputFile, big);
+
+    std::cout << "[OK] externalQuicksort sorted correctly with 4 threads.\n";
+
+    // Pivot sampling: block and full-scan modes, reproducible per seed
+    for (size_t blocks : {0, 4, 1000}) {
+        SortOptions sampling;
+        sampling.sampleBlocks = blocks;
+        PivotSample a = samplePivots(inputFile, 64 * 1024, 8, sampling);
+        PivotSample b = samplePivots(inputFile, 64 * 1024, 8, sampling);
+        assert(a.pivots == b.pivots && "Same seed must give the same pivots!");
+        assert(a.pivots.size() == 7 && std::is_sorted(a.pivots.begin(), a.pivots.end()));
+        assert(a.sampleSize > 0 && a.imbalance >= 1.0 && a.imbalance < 1.5);
+        externalQuicksort(inputFile, outputFile, 64 * 1024, 8, sampling);
+        assert(readBinary(outputFile) == bigExpected && "Sampled pivots broke the sort!");
+    }
+    std::vector<int64_t> skewed(20000, 7);
+    for (size_t i = 0; i < skewed.size(); i += 10) skewed[i] = static_cast<int64_t>(i);
+    writeBinary(inputFile, skewed);
+    PivotSample heavy = samplePivots(inputFile, 64 * 1024, 8);
+    assert(heavy.pivots == std::vector<int64_t>{7} && heavy.equal == std::vector<bool>{true} &&
+           "A heavy value must become one pivot with an equality bucket!");
+    assert(heavy.imbalance < 1.5 && "Equality buckets must not count as imbalance!");
+    writeBinary(inputFile, big);
+
+    std::cout << "[OK] samplePivots gave reproducible splitters.\n";
+
+    // In-memory kernels on network-sized leaves, duplicates and extreme keys
+    for (size_t n : {0, 1, 7, 16, 17, 33, 1000, 5000}) {
+        std::vector<int64_t> keys(n);
+        for (size_t i = 0; i < n; ++i)
+            keys[i] = i % 3 == 0 ? INT64_MIN : i % 3 == 1 ? INT64_MAX : static_cast<int64_t>(rng() % 5);
+        std::vector<int64_t> expectedKeys = keys;
+        std::sort(expectedKeys.begin(), expectedKeys.end());
+        for (InMemorySort kernel : {InMemorySort::Std, InMemorySort::Simd, InMemorySort::Radix}) {
+            std::vector<int64_t> sortedKeys = keys;
+            sortBuffer(sortedKeys.data(), n, kernel);
+            assert(sortedKeys == expectedKeys && "In-memory kernel failed to sort!");
+        }
+    }
+    // Radix above its 256-value leaf on random full-range keys and on
+    // mixed-sign keys of every magnitude, then Auto past its 2^20-value
+    // radix threshold
+    auto mixedSign = [&]() {
+        int64_t x = static_cast<int64_t>(rng()) >> (rng() % 64);
+        return rng() % 2 ? x : static_cast<int64_t>(rng() % 2001) - 1000;
+    };
+    for (size_t n : {257, 4099, 100000}) {
+        std::vector<int64_t> fullRange(n), signs(n);
+        for (size_t i = 0; i < n; ++i) {
+            fullRange[i] = static_cast<int64_t>(rng());
+            signs[i] = mixedSign();
+        }
+        for (std::vector<int64_t>* keys : {&fullRange, &signs}) {
+            std::vector<int64_t> expectedKeys = *keys;
+            std::sort(expectedKeys.begin(), expectedKeys.end());
+            sortBuffer(keys->data(), n, InMemorySort::Radix);
+            assert(*keys == expectedKeys && "Radix sort failed on wide keys!");
+        }
+    }
+    std::vector<int64_t> large((size_t(1) << 20) + 17);
+    for (auto& x : large) x = mixedSign();
+    std::vector<int64_t> largeExpected = large;
+    std::sort(largeExpected.begin(), largeExpected.end());
+    sortBuffer(large.data(), large.size(), InMemorySort::Auto);
+    assert(large == largeExpected && "Auto failed above the radix threshold!");
+
+    std::cout << "[OK] in-memory sort kernels sorted correctly"
+              << (simdSortAvailable() ? " (AVX2)" : " (scalar)") << ".\n";
+
+    // Memory-mapped in-memory path, including an empty file
+    SortOptions mapped;
+    mapped.mapPopulate = true;
+    writeBinary(inputFile, data);
+    externalQuicksort(inputFile, outputFile, memLimit * 4, partitions, mapped);
+    assert(readBinary(outputFile) == expected && "Mapped in-memory sort failed!");
+    writeBinary(inputFile, {});
+    externalQuicksort(inputFile, outputFile, memLimit, partitions, mapped);
+    assert(readBinary(outputFile).empty() && "Empty input must give an empty output!");
+
+    std::cout << "[OK] externalQuicksort sorted a memory-mapped input and an empty file.\n";
+
+    // Tree classification must agree with lower_bound, including repeated and
+    // extreme pivots and a pivot count that is not 2^k - 1
+    std::vector<int64_t> pivots = {INT64_MIN, -5, 0, 0, 3, 3, 3, 17, 1000, INT64_MAX};
+    std::vector<int64_t> mixed(10007);
+    for (auto& x : mixed)
+        x = rng() % 4 == 0 ? pivots[rng() % pivots.size()] : static_cast<int64_t>(rng() % 2000) - 100;
+    writeBinary(inputFile, mixed);
+    ScratchSpace scratch({"test"}, 4096);
+    std::vector<ScratchRun> partRuns;
+    auto partCounts = partitionFile(inputFile, pivots, partRuns, scratch, 64 * 1024, SortOptions{4096});
+    assert(partRuns.size() == pivots.size() + 1);
+    std::vector<std::vector<int64_t>> expectParts(partRuns.size());
+    for (int64_t x : mixed)
+        expectParts[std::lower_bound(pivots.begin(), pivots.end(), x) - pivots.begin()].push_back(x);
+    for (size_t i = 0; i < partRuns.size(); ++i) {
+        assert(readRun(scratch, partRuns[i]) == expectParts[i] && "Partition misclassified values!");
+        assert(partCounts[i] == expectParts[i].size() && "Partition size miscounted!");
+        // A partition maps back as one span across its extents
+        MappedFile mapped(scratch, partRuns[i]);
+        assert(std::vector<int64_t>(mapped.begin(), mapped.end()) == expectParts[i]);
+        scratch.release(partRuns[i]);
+    }
+
+    std::cout << "[OK] partitionFile classified values like lower_bound.\n";
+
+    // Selection: out-of-range values never reach a partition, partitions
+    // outside the range get no stream, and top-K / distinct cut the output
+    SortOptions ranged{4096};
+    ranged.minKey = 0;
+    ranged.maxKey = 3;
+    partCounts = partitionFile(inputFile, pivots, partRuns, scratch, 64 * 1024, ranged);
+    for (size_t i = 0; i < partRuns.size(); ++i) {
+        std::vector<int64_t> kept;
+        for (int64_t x : expectParts[i])
+            if (x >= 0 && x <= 3) kept.push_back(x);
+        assert(readRun(scratch, partRuns[i]) == kept && partCounts[i] == kept.size());
+        assert((i >= 2 && i <= 6) || partRuns[i].extents.empty());
+        scratch.release(partRuns[i]);
+    }
+    std::vector<int64_t> wide(200000);
+    for (auto& x : wide) x = static_cast<int64_t>(rng() % 50000);
+    writeBinary(inputFile, wide);
+    std::sort(wide.begin(), wide.end());
+    for (size_t threads : {1, 3}) {
+        SortOptions sel{4096};
+        sel.threads = threads;
+        sel.limit = 30000;
+        externalQuicksort(inputFile, outputFile, 64 * 1024, 4, sel);
+        assert(readBinary(outputFile) == std::vector<int64_t>(wide.begin(), wide.begin() + 30000) &&
+               "quicksort top-K failed!");
+        sel.limit = 0;
+        sel.distinct = true;
+        sel.minKey = 1000;
+        sel.maxKey = 40000;
+        externalQuicksort(inputFile, outputFile, 64 * 1024, 4, sel);
+        std::vector<int64_t> expectDistinct;
+        for (int64_t x : wide)
+            if (x >= 1000 && x <= 40000 && (expectDistinct.empty() || expectDistinct.back() != x))
+                expectDistinct.push_back(x);
+        assert(readBinary(outputFile) == expectDistinct && "quicksort distinct range failed!");
+    }
+
+    std::cout << "[OK] externalQuicksort applied top-K, key range and distinct.\n";
+
+    // Equality buckets: copies of a heavy pivot are counted, not written
+    PivotSample split;
+    split.pivots = {-5, 0, 3, 17};
+    split.equal = {false, true, true, false};
+    writeBinary(inputFile, mixed);
+    std::vector<uint64_t> equalCounts;
+    partCounts = partitionFile(inputFile, split, partRuns, equalCounts, scratch, 64 * 1024,
+                               SortOptions{4096});
+    assert(partRuns.size() == 5 && equalCounts.size() == 4);
+    std::vector<std::vector<int64_t>> expectSplit(5);
+    std::vector<uint64_t> expectEqual(4, 0);
+    for (int64_t x : mixed) {
+        size_t b = std::lower_bound(split.pivots.begin(), split.pivots.end(), x) - split.pivots.begin();
+        if (b < 4 && split.equal[b] && x == split.pivots[b])
+            ++expectEqual[b];
+        else
+            expectSplit[b].push_back(x);
+    }
+    assert(equalCounts == expectEqual && expectEqual[1] > 0 && "Equality bucket miscounted!");
+    for (size_t i = 0; i < partRuns.size(); ++i) {
+        assert(readRun(scratch, partRuns[i]) == expectSplit[i] && partCounts[i] == expectSplit[i].size());
+        scratch.release(partRuns[i]);
+    }
+
+    // Low-cardinality keys and a single repeated value, many times M, end in
+    // equality buckets instead of partitions that never shrink
+    std::vector<int64_t> lowCard(300000);
+    for (auto& x : lowCard) x = static_cast<int64_t>(rng() % 3) - 1;
+    std::vector<int64_t> lowExpected = lowCard;
+    std::sort(lowExpected.begin(), lowExpected.end());
+    std::vector<int64_t> single(300000, 42);
+    for (size_t threads : {1, 3}) {
+        for (int parts : {2, 8}) {
+            SortOptions dup{4096};
+            dup.threads = threads;
+            writeBinary(inputFile, lowCard);
+            externalQuicksort(inputFile, outputFile, 64 * 1024, parts, dup);
+            assert(readBinary(outputFile) == lowExpected && "Low-cardinality quicksort failed!");
+            writeBinary(inputFile, single);
+            externalQuicksort(inputFile, outputFile, 64 * 1024, parts, dup);
+            assert(readBinary(outputFile) == single && "Single-value quicksort failed!");
+        }
+    }
+    SortOptions dupSel{4096};
+    writeBinary(inputFile, lowCard);
+    dupSel.distinct = true;
+    externalQuicksort(inputFile, outputFile, 64 * 1024, 4, dupSel);
+    assert(readBinary(outputFile) == (std::vector<int64_t>{-1, 0, 1}) && "Distinct buckets failed!");
+    dupSel.distinct = false;
+    dupSel.limit = 150000;
+    externalQuicksort(inputFile, outputFile, 64 * 1024, 4, dupSel);
+    assert(readBinary(outputFile) == std::vector<int64_t>(lowExpected.begin(), lowExpected.begin() + 150000) &&
+           "Top-K over equality buckets failed!");
+
+    std::cout << "[OK] externalQuicksort split heavy duplicates into equality buckets.\n";
+
+    // Partitions striped over several scratch directories, also as parallel tasks
+    std::vector<std::string> stripeDirs = {"test/stripe0", "test/stripe1", "test/stripe2"};
+    for (auto& d : stripeDirs) std::filesystem::create_directories(d);
+    writeBinary(inputFile, big);
+    for (size_t threads : {1, 3}) {
+        SortOptions striped{4096};
+        striped.scratchDirs = stripeDirs;
+        striped.threads = threads;
+        externalQuicksort(inputFile, outputFile, 64 * 1024, 4, striped);
+        assert(readBinary(outputFile) == bigExpected && "Striped quicksort failed to sort!");
+    }
+    for (auto& d : stripeDirs) std::filesystem::remove(d);
+
+    std::cout << "[OK] externalQuicksort striped partitions over several scratch directories.\n";
     return 0;
 }